@@ -0,0 +1,183 @@
+#include "ast_visitor.h"
+#include "code_transformer.h"
+#include "tu_generator.h"
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// Every operator new of the process is counted, so the bench can report what
+// the analysis allocates. Growing a SmallVector goes through malloc and is
+// not included.
+namespace {
+uint64_t allocationCount = 0;
+uint64_t allocatedBytes = 0;
+} // namespace
+
+void* operator new(std::size_t size) {
+    ++allocationCount;
+    allocatedBytes += size;
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+
+llvm::cl::OptionCategory BenchCategory("Benchmark Options");
+llvm::cl::opt<unsigned> Functions("functions",
+    llvm::cl::desc("Functions in the generated translation unit"),
+    llvm::cl::init(200), llvm::cl::cat(BenchCategory));
+llvm::cl::opt<unsigned> Locals("locals",
+    llvm::cl::desc("Locals per function"),
+    llvm::cl::init(8), llvm::cl::cat(BenchCategory));
+llvm::cl::opt<unsigned> Depth("depth",
+    llvm::cl::desc("Nested if/else levels per function"),
+    llvm::cl::init(3), llvm::cl::cat(BenchCategory));
+llvm::cl::opt<unsigned> Loops("loops",
+    llvm::cl::desc("Nested loops per function"),
+    llvm::cl::init(1), llvm::cl::cat(BenchCategory));
+llvm::cl::opt<unsigned> Args("args",
+    llvm::cl::desc("By-value arguments per call"),
+    llvm::cl::init(2), llvm::cl::cat(BenchCategory));
+llvm::cl::opt<unsigned> Iterations("iterations",
+    llvm::cl::desc("Runs to take the fastest of"),
+    llvm::cl::init(5), llvm::cl::cat(BenchCategory));
+llvm::cl::opt<bool> DumpSource("dump-source",
+    llvm::cl::desc("Print the generated translation unit and exit"),
+    llvm::cl::cat(BenchCategory));
+
+using Duration = std::chrono::nanoseconds;
+
+// Timings of one run over the generated unit
+struct RunTimes {
+    Duration parse{0};
+    move_optimizer::PhaseTimes phases;
+    Duration rewrite{0};
+    move_optimizer::AnalysisStats stats;
+    size_t transformations = 0;
+    uint64_t allocations = 0;   // operator new calls made by the analysis
+    uint64_t bytes = 0;
+};
+
+RunTimes runOnce(const std::string& code) {
+    RunTimes times;
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<clang::ASTUnit> unit =
+        clang::tooling::buildASTFromCodeWithArgs(code, {"-std=c++17"}, "bench.cpp");
+    times.parse = std::chrono::steady_clock::now() - start;
+    if (!unit) {
+        return times;
+    }
+
+    clang::ASTContext& context = unit->getASTContext();
+    move_optimizer::ASTVisitor visitor(context);
+    visitor.setPhaseTimes(&times.phases);
+    const uint64_t allocationsBefore = allocationCount;
+    const uint64_t bytesBefore = allocatedBytes;
+    visitor.TraverseDecl(context.getTranslationUnitDecl());
+    times.allocations = allocationCount - allocationsBefore;
+    times.bytes = allocatedBytes - bytesBefore;
+    times.stats = visitor.getStats();
+    times.transformations = visitor.getTransformations().size();
+
+    // Rewriting covers the edits and streaming the rewritten buffer out.
+    start = std::chrono::steady_clock::now();
+    clang::Rewriter rewriter(unit->getSourceManager(), unit->getLangOpts());
+    move_optimizer::CodeTransformer transformer(context, &rewriter);
+    transformer.applyTransformations(visitor.getTransformations());
+    if (const clang::RewriteBuffer* buffer =
+            rewriter.getRewriteBufferFor(unit->getSourceManager().getMainFileID())) {
+        buffer->write(llvm::nulls());
+    }
+    times.rewrite = std::chrono::steady_clock::now() - start;
+    return times;
+}
+
+void printPhase(llvm::StringRef name, Duration time, unsigned functions) {
+    const double ms = std::chrono::duration<double, std::milli>(time).count();
+    const double usPerFunction =
+        functions ? std::chrono::duration<double, std::micro>(time).count() / functions : 0.0;
+    llvm::outs() << llvm::format("%-18s %10.3f ms %10.3f us/function\n",
+                                 name.str().c_str(), ms, usPerFunction);
+}
+
+} // namespace
+
+int main(int argc, const char** argv) {
+    llvm::cl::HideUnrelatedOptions(BenchCategory);
+    llvm::cl::ParseCommandLineOptions(argc, argv,
+                                      "Times the analysis phases on a generated unit\n");
+
+    move_optimizer::bench::GeneratorOptions options;
+    options.functions = Functions;
+    options.localsPerFunction = Locals;
+    options.cfgDepth = Depth;
+    options.loopNesting = Loops;
+    options.argsPerCall = Args;
+    const std::string code = move_optimizer::bench::generateTranslationUnit(options);
+    if (DumpSource) {
+        llvm::outs() << code;
+        return 0;
+    }
+
+    // Keep the fastest run of each phase; slower ones measure noise.
+    RunTimes best;
+    for (unsigned i = 0; i < std::max(1u, unsigned(Iterations)); ++i) {
+        RunTimes times = runOnce(code);
+        if (i == 0) {
+            best = times;
+            continue;
+        }
+        best.parse = std::min(best.parse, times.parse);
+        best.phases.cfgBuild = std::min(best.phases.cfgBuild, times.phases.cfgBuild);
+        best.phases.useCollection =
+            std::min(best.phases.useCollection, times.phases.useCollection);
+        best.phases.lastUseQueries =
+            std::min(best.phases.lastUseQueries, times.phases.lastUseQueries);
+        best.rewrite = std::min(best.rewrite, times.rewrite);
+        best.allocations = std::min(best.allocations, times.allocations);
+        best.bytes = std::min(best.bytes, times.bytes);
+    }
+    if (best.stats.functionsSeen == 0) {
+        llvm::errs() << "Error: the generated unit did not parse\n";
+        return 1;
+    }
+
+    llvm::outs() << "functions " << options.functions << ", locals " << options.localsPerFunction
+                 << ", depth " << options.cfgDepth << ", loops " << options.loopNesting
+                 << ", args " << options.argsPerCall << " (" << code.size() << " bytes)\n"
+                 << "CFGs built " << best.stats.cfgsBuilt << ", moves found "
+                 << best.transformations << "\n";
+    const unsigned functions = best.stats.functionsSeen;
+    printPhase("parse", best.parse, functions);
+    printPhase("CFG build", best.phases.cfgBuild, functions);
+    printPhase("use collection", best.phases.useCollection, functions);
+    printPhase("last-use queries", best.phases.lastUseQueries, functions);
+    printPhase("rewriting", best.rewrite, functions);
+    llvm::outs() << llvm::format("%-18s %10llu    %10.1f per function (%llu bytes)\n",
+                                 "allocations",
+                                 static_cast<unsigned long long>(best.allocations),
+                                 functions ? double(best.allocations) / functions : 0.0,
+                                 static_cast<unsigned long long>(best.bytes));
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "tu_generator.h"
+#include <algorithm>
+#include <sstream>
+
+namespace move_optimizer {
+namespace bench {
+
+namespace {
+
+void indent(std::ostringstream& os, unsigned level) {
+    os << std::string(level * 4, ' ');
+}
+
+// Pass every local once, argsPerCall of them per call
+void emitSinkCalls(std::ostringstream& os, const GeneratorOptions& options, unsigned level) {
+    for (unsigned first = 0; first < options.localsPerFunction; first += options.argsPerCall) {
+        const unsigned last = std::min(first + options.argsPerCall, options.localsPerFunction);
+        indent(os, level);
+        os << "sink" << (last - first) << "(";
+        for (unsigned i = first; i < last; ++i) {
+            os << (i == first ? "" : ", ") << "w" << i;
+        }
+        os << ");\n";
+    }
+}
+
+void emitBranches(std::ostringstream& os, const GeneratorOptions& options, unsigned depth,
+                  unsigned level) {
+    if (depth == options.cfgDepth) {
+        emitSinkCalls(os, options, level);
+        return;
+    }
+
+    indent(os, level);
+    os << "if (n > " << depth << ") {\n";
+    emitBranches(os, options, depth + 1, level + 1);
+    indent(os, level);
+    os << "} else {\n";
+    for (unsigned i = depth % 2; i < options.localsPerFunction; i += 2) {
+        indent(os, level + 1);
+        os << "inspect(w" << i << ");\n";
+    }
+    indent(os, level);
+    os << "}\n";
+}
+
+} // namespace
+
+std::string generateTranslationUnit(const GeneratorOptions& input) {
+    GeneratorOptions options = input;
+    options.argsPerCall = std::max(options.argsPerCall, 1u);
+
+    std::ostringstream os;
+    os << "struct Widget {\n"
+          "    Widget();\n"
+          "    Widget(const Widget&);\n"
+          "    Widget(Widget&&);\n"
+          "    Widget& operator=(const Widget&);\n"
+          "    Widget& operator=(Widget&&);\n"
+          "    ~Widget();\n"
+          "    int value;\n"
+          "};\n\n"
+          "void inspect(const Widget&);\n";
+    for (unsigned arity = 1; arity <= options.argsPerCall; ++arity) {
+        os << "void sink" << arity << "(";
+        for (unsigned i = 0; i < arity; ++i) {
+            os << (i == 0 ? "" : ", ") << "Widget";
+        }
+        os << ");\n";
+    }
+
+    for (unsigned f = 0; f < options.functions; ++f) {
+        os << "\nvoid function" << f << "(int n) {\n";
+        for (unsigned i = 0; i < options.localsPerFunction; ++i) {
+            os << "    Widget w" << i << ";\n";
+        }
+
+        unsigned level = 1;
+        for (unsigned loop = 0; loop < options.loopNesting; ++loop, ++level) {
+            indent(os, level);
+            os << "for (int i" << loop << " = 0; i" << loop << " < n; ++i" << loop << ") {\n";
+        }
+        emitBranches(os, options, 0, level);
+        while (level > 1) {
+            --level;
+            indent(os, level);
+            os << "}\n";
+        }
+
+        emitSinkCalls(os, options, 1);
+        os << "}\n";
+    }
+    return os.str();
+}
+
+} // namespace bench
+} // namespace move_optimizer
@@ -0,0 +1,26 @@
+#ifndef TU_GENERATOR_H
+#define TU_GENERATOR_H
+
+#include <string>
+
+namespace move_optimizer {
+namespace bench {
+
+// Shape of a generated translation unit
+struct GeneratorOptions {
+    unsigned functions = 100;
+    unsigned localsPerFunction = 8;
+    unsigned cfgDepth = 3;          // Nested if/else levels inside the loops
+    unsigned loopNesting = 1;       // Nested for loops around the branches
+    unsigned argsPerCall = 2;       // By-value arguments per call
+};
+
+// Self-contained C++17 source with options.functions functions. Each one
+// copies its locals into calls inside the loops and branches, which must stay
+// copies, and passes every local once more after the loops, which can move.
+std::string generateTranslationUnit(const GeneratorOptions& options);
+
+} // namespace bench
+} // namespace move_optimizer
+
+#endif // TU_GENERATOR_H
@@ -8,21 +8,39 @@
 #include <clang/AST/Decl.h>
 #include <clang/AST/DeclCXX.h>
 #include <clang/Analysis/CFG.h>
+#include <clang/Tooling/Core/Replacement.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Allocator.h>
+#include <chrono>
+#include <cstdint>
+#include <map>
 #include <vector>
 #include <string>
-#include <map>
 #include <memory>
-#include <unordered_map>
+#include <optional>
 
 namespace move_optimizer {
 
+class DecisionStore;
+
 // Represents a transformation opportunity
 struct Transformation {
     enum Type {
         RETURN_VALUE_MOVE,      // Move return value
         FUNCTION_ARG_MOVE,      // Move function argument
         VARIABLE_ASSIGNMENT_MOVE, // Move variable assignment
-        CONSTRUCTOR_INIT_MOVE   // Move constructor initialization
+        CONSTRUCTOR_INIT_MOVE,  // Move constructor initialization
+        EMPLACE_INSERT,         // Construct an inserted temporary in place
+        TRY_EMPLACE_INSERT,     // Insert a map entry with try_emplace
+        SINK_PARAM_BY_VALUE,    // Take a const& sink parameter by value
+        SINK_PARAM_MOVE,        // Move that parameter into its storage
+        READONLY_PARAM_BY_REF,  // Take a read-only by-value parameter by const&
+        RANGE_FOR_CONST_REF,    // Bind a read-only range-for variable by const&
+        RANGE_FOR_CONSUME       // Bind it by reference to a range at its last use
     };
     
     Type type;
@@ -30,50 +48,196 @@ struct Transformation {
     std::string originalCode;
     std::string transformedCode;
     clang::SourceRange range;
+    const clang::FunctionDecl* function = nullptr;  // Function the move is in
+    uint64_t copyCost = 0;      // Estimated cost of the copy the move avoids
+    uint64_t executionCount = 0; // Of function, from the profile if there is one
+    const char* reportOnly = nullptr; // Why a signature change is only listed
     
     Transformation(Type t, clang::SourceLocation loc, clang::SourceRange r)
         : type(t), location(loc), range(r) {}
 };
 
+// Whether type is part of a signature change, which has to reach every
+// declaration of the function or none
+inline bool isSignatureChange(Transformation::Type type) {
+    return type == Transformation::SINK_PARAM_BY_VALUE || type == Transformation::SINK_PARAM_MOVE ||
+           type == Transformation::READONLY_PARAM_BY_REF;
+}
+
+// What to do with parameters whose signature could be better
+enum class SignatureChanges {
+    Off,
+    Report,         // List them with the candidates
+    Rewrite         // Change every declaration in the translation unit
+};
+
+// The emplace member that replaces method (push_back, push_front, push or
+// insert) in an EMPLACE_INSERT, or empty if there is none
+llvm::StringRef emplaceCounterpart(llvm::StringRef method);
+
+// Edits of one run, keyed by the path of the file they apply to
+using FileEdits = std::map<std::string, clang::tooling::Replacements>;
+
+// Per-translation-unit analysis counters.
+struct AnalysisStats {
+    unsigned functionsSeen = 0;
+    unsigned cfgsBuilt = 0;
+    unsigned cfgBuildsSkipped = 0;
+    unsigned functionsReused = 0;
+    unsigned candidates = 0;        // Moves the analysis asked for
+    unsigned movesApplied = 0;      // Moves that made it into the edits
+    uint64_t bytesWritten = 0;      // Size of the files written
+
+    AnalysisStats& operator+=(const AnalysisStats& other) {
+        functionsSeen += other.functionsSeen;
+        cfgsBuilt += other.cfgsBuilt;
+        cfgBuildsSkipped += other.cfgBuildsSkipped;
+        functionsReused += other.functionsReused;
+        candidates += other.candidates;
+        movesApplied += other.movesApplied;
+        bytesWritten += other.bytesWritten;
+        return *this;
+    }
+};
+
+// Wall time spent in each analysis phase. Only measured for a visitor that
+// is given somewhere to put it, as the benchmarks do.
+struct PhaseTimes {
+    std::chrono::nanoseconds cfgBuild{0};
+    std::chrono::nanoseconds useCollection{0};  // Including the liveness pass
+    std::chrono::nanoseconds lastUseQueries{0}; // Candidate checks in calls and returns
+};
+
 class ASTVisitor : public clang::RecursiveASTVisitor<ASTVisitor> {
+    using Base = clang::RecursiveASTVisitor<ASTVisitor>;
+
 public:
     explicit ASTVisitor(clang::ASTContext& context);
+
+    // Reuse and record per-function decisions in store (may be null)
+    void setDecisionStore(DecisionStore* store) { decisionStore_ = store; }
+
+    // Also rewrite inserts into these user containers (qualified class
+    // names) as emplaces; standard containers always are
+    void setEmplaceContainers(std::vector<std::string> names) {
+        emplaceContainers_ = std::move(names);
+    }
+
+    // Look for const& parameters that are only copied into members
+    void setSinkParams(SignatureChanges mode) { sinkParams_ = mode; }
+
+    // Look for by-value parameters that are only read
+    void setReadOnlyParams(SignatureChanges mode) { readOnlyParams_ = mode; }
+
+    // Accumulate phase timings into times (may be null)
+    void setPhaseTimes(PhaseTimes* times) { phaseTimes_ = times; }
+
+    // Replays stored decisions for unchanged functions instead of visiting them
+    bool TraverseDecl(clang::Decl* decl);
+
+    // Tracks the full-expression being visited
+    bool TraverseStmt(clang::Stmt* stmt, DataRecursionQueue* queue = nullptr);
     
     // Visit declarations
     bool VisitFunctionDecl(clang::FunctionDecl* decl);
     bool VisitCallExpr(clang::CallExpr* expr);
     bool VisitReturnStmt(clang::ReturnStmt* stmt);
+    bool VisitCXXOperatorCallExpr(clang::CXXOperatorCallExpr* expr);
+    bool VisitVarDecl(clang::VarDecl* decl);
+    bool TraverseConstructorInitializer(clang::CXXCtorInitializer* init);
+    bool VisitCXXMemberCallExpr(clang::CXXMemberCallExpr* expr);
+    bool TraverseCXXForRangeStmt(clang::CXXForRangeStmt* loop);
     
     // Get collected transformations
     const std::vector<Transformation>& getTransformations() const { return transformations_; }
     void clearTransformations() { transformations_.clear(); }
+    const AnalysisStats& getStats() const { return stats_; }
     
 private:
-    struct UsePosition {
+    // One reference to a liveness candidate, or one element that gives it a
+    // new value, in CFG order.
+    struct UseSite {
+        unsigned variable;      // Index into variableIndex_
         unsigned blockId;
         unsigned elementIndex;
-        clang::SourceLocation location;
+        bool liveAfter;         // The variable may be read again after this element
+        bool kills;             // The element declares or assigns the whole variable
     };
 
     clang::ASTContext& context_;
     std::vector<Transformation> transformations_;
+    AnalysisStats stats_;
+    DecisionStore* decisionStore_;
+    PhaseTimes* phaseTimes_;
+    std::vector<std::string> emplaceContainers_;
+    SignatureChanges sinkParams_;
+    SignatureChanges readOnlyParams_;
     
     clang::FunctionDecl* currentFunction_;
+    const clang::Expr* currentFullExpr_;
     std::unique_ptr<clang::CFG> currentFunctionCfg_;
-    std::map<const clang::VarDecl*, std::vector<UsePosition>> variableUsePositions_;
-    std::unordered_map<unsigned, const clang::CFGBlock*> cfgBlocksById_;
+
+    // Per-function analysis state. Tables whose size is known once the CFG
+    // exists are carved out of functionArena_, which is reset for the next
+    // function; the growable ones are cleared but keep their capacity.
+    llvm::BumpPtrAllocator functionArena_;
+    llvm::MutableArrayRef<const clang::CFGBlock*> cfgBlocksById_;
+    // [begin, end) of each block's uses in uses_, indexed by block ID.
+    llvm::MutableArrayRef<std::pair<unsigned, unsigned>> blockUses_;
+    llvm::DenseMap<const clang::VarDecl*, unsigned> variableIndex_;
+    std::vector<UseSite> uses_;
+    // Each DeclRefExpr is recorded once, so the expression itself is the key.
+    llvm::DenseMap<const clang::DeclRefExpr*, unsigned> useIndex_;
+    llvm::DenseSet<const clang::Stmt*> elementStmts_;
+    // Left-hand sides of whole-object assignments, which are not reads.
+    llvm::DenseSet<const clang::DeclRefExpr*> overwrittenRefs_;
+    llvm::SmallVector<const clang::Stmt*, 32> pendingStmts_;
+    llvm::DenseMap<const clang::Type*, uint64_t> copyCosts_;
     
     // Helper methods
-    bool isCopyOperation(clang::Expr* expr);
+    clang::DeclRefExpr* getReturnedVariable(clang::Expr* value,
+                                            clang::CXXConstructExpr*& construct);
+    bool returnCopiesLocal(const clang::ReturnStmt* stmt,
+                           const clang::CXXConstructExpr* construct);
     bool hasMoveConstructor(clang::QualType type);
     bool isSafeToMove(clang::Expr* expr, const clang::Stmt* context);
-    bool isLastUseInCurrentFunction(const clang::VarDecl* var, clang::SourceLocation useLoc) const;
+    bool isMovableVariable(const clang::DeclRefExpr* ref);
+    const clang::DeclRefExpr* getMovableArgument(const clang::CallExpr* call, unsigned index);
+    const clang::DeclRefExpr* getMovableAssignmentSource(const clang::CXXOperatorCallExpr* call);
+    const clang::DeclRefExpr* getMovableInitSource(const clang::VarDecl* var);
+    const clang::DeclRefExpr* getMovableInitializerSource(const clang::CXXCtorInitializer* init);
+    bool hasMoveAssignment(clang::QualType type);
+    bool isEmplaceContainer(const clang::CXXRecordDecl* record) const;
+    const clang::Expr* getEmplaceableTemporary(const clang::CXXMemberCallExpr* call,
+                                               Transformation::Type& type);
+    bool hasMoveCandidates(const clang::FunctionDecl* function);
+    bool isSignatureChangeable(const clang::FunctionDecl* function);
+    bool isSinkParamType(const clang::ParmVarDecl* param);
+    const clang::DeclRefExpr* findSinkUse(const clang::ParmVarDecl* param);
+    void findSinkParams();
+    bool isReadOnlyParamType(const clang::ParmVarDecl* param);
+    static bool isReadOnlyUse(const clang::DeclRefExpr* ref,
+                              const llvm::DenseMap<const clang::Stmt*, const clang::Stmt*>& parents);
+    void findReadOnlyParams();
+    static const clang::VarDecl* getCopiedLoopVariable(const clang::CXXForRangeStmt* loop);
+    static const clang::DeclRefExpr* getConsumableRange(const clang::CXXForRangeStmt* loop);
+    bool hasMoveCandidates(const clang::Stmt* body);
+    static bool referencesVariable(const clang::Stmt* stmt, const clang::ValueDecl* var);
+    static bool isReferencedElsewhere(const clang::Stmt* stmt, const clang::DeclRefExpr* ref);
+    bool isLastUseInCurrentFunction(const clang::DeclRefExpr* ref) const;
     void collectUsesForCurrentFunction();
-    bool canOccurAfter(const UsePosition& current, const UsePosition& candidate) const;
-    bool isReachable(const clang::CFGBlock* from, const clang::CFGBlock* to) const;
-    bool blockCanReachItself(const clang::CFGBlock* block) const;
-    const UsePosition* findUsePosition(const clang::VarDecl* var, clang::SourceLocation useLoc) const;
+    void computeLiveness();
+    static bool isLivenessCandidate(const clang::VarDecl* var);
+    static const clang::DeclRefExpr* getOverwrittenVariable(const clang::Stmt* stmt);
     static clang::Expr* ignoreImplicit(clang::Expr* expr);
+    void addTransformation(Transformation::Type type, clang::SourceLocation loc,
+                           clang::SourceRange range, clang::QualType valueType);
+    uint64_t estimateCopyCost(clang::QualType type);
+    uint64_t estimateHeapCost(clang::QualType type, unsigned depth);
+    std::optional<uint64_t> fingerprintFunction(const clang::FunctionDecl* function);
+    bool replayDecisions(const clang::FunctionDecl* function, uint64_t fingerprint);
+    void recordDecisions(const clang::FunctionDecl* function, uint64_t fingerprint,
+                         size_t firstTransformation);
 };
 
 } // namespace move_optimizer
@@ -4,6 +4,11 @@
 #include "ast_visitor.h"
 #include <clang/Rewrite/Core/Rewriter.h>
 #include <clang/AST/ASTContext.h>
+#include <clang/Tooling/Core/Replacement.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
 #include <string>
 #include <vector>
 
@@ -11,8 +16,16 @@ namespace move_optimizer {
 
 class CodeTransformer {
 public:
-    CodeTransformer(clang::ASTContext& context, clang::Rewriter& rewriter);
+    // Without a rewriter, edits are only recorded as replacements.
+    CodeTransformer(clang::ASTContext& context, clang::Rewriter* rewriter);
     
+    // Also allow edits in non-system headers below root, which must be a
+    // real path. Empty keeps edits in the main file.
+    void setHeaderRoot(std::string root) { headerRoot_ = std::move(root); }
+
+    // Whether loc is in the main file or a header below the root
+    bool isEditableFile(clang::SourceLocation loc) const;
+
     // Apply a single transformation
     bool applyTransformation(const Transformation& transformation);
     
@@ -21,6 +34,14 @@ public:
     
     // Get transformed code
     std::string getTransformedCode() const;
+
+    // Every edit made to the file, so that it can be replayed or exported.
+    // Incomplete when an edit could not be recorded as a replacement.
+    const FileEdits& getReplacements() const { return replacements_; }
+    bool hasCompleteReplacements() const { return replacementsComplete_; }
+
+    // std::move calls inserted and inserts turned into emplaces so far
+    unsigned getMovesApplied() const { return movesApplied_; }
     
     // Safety checks
     bool validateTransformation(const Transformation& transformation);
@@ -28,18 +49,33 @@ public:
     
 private:
     clang::ASTContext& context_;
-    clang::Rewriter& rewriter_;
+    clang::Rewriter* rewriter_;
     std::vector<clang::SourceRange> appliedRanges_;
-    bool insertedMoveInFile_;
-    bool utilityHeaderEnsured_;
+    std::string headerRoot_;
+    llvm::SmallVector<clang::FileID, 4> filesWithMoves_;
+    llvm::DenseSet<clang::FileID> utilityHeaderEnsured_;
+    FileEdits replacements_;
+    bool replacementsComplete_;
+    unsigned movesApplied_;
     
     // Helper methods
     bool insertMove(clang::SourceLocation loc, clang::SourceRange range);
     bool wrapWithMove(clang::SourceRange range);
+    bool rewriteAsEmplace(const Transformation& transformation);
+    bool planByValue(clang::SourceRange range,
+                     llvm::SmallVectorImpl<clang::CharSourceRange>& removals) const;
+    bool rewriteAsByValue(const Transformation& transformation);
+    bool planByReference(
+        clang::SourceRange range, bool addConst,
+        llvm::SmallVectorImpl<std::pair<clang::SourceLocation, llvm::StringRef>>& insertions) const;
+    bool rewriteAsByReference(const Transformation& transformation);
+    clang::SourceLocation findMatchingParen(clang::SourceRange range) const;
     std::string generateMoveCode(const Transformation& transformation);
     bool checkOverlap(clang::SourceRange range);
     bool isValidMoveTarget(clang::Expr* expr);
-    bool ensureUtilityHeader();
+    bool ensureUtilityHeader(clang::FileID file);
+    void recordInsertion(clang::SourceLocation loc, llvm::StringRef text);
+    void recordReplacement(clang::SourceLocation loc, unsigned length, llvm::StringRef text);
 };
 
 } // namespace move_optimizer
@@ -0,0 +1,57 @@
+#ifndef DECISION_STORE_H
+#define DECISION_STORE_H
+
+#include "ast_visitor.h"
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace move_optimizer {
+
+// A transformation with its locations stored as byte offsets from the start
+// of the function that produced it.
+struct StoredDecision {
+    Transformation::Type type;
+    unsigned location;
+    unsigned rangeBegin;
+    unsigned rangeEnd;
+    uint64_t copyCost;
+};
+
+// Persistent map from function fingerprints to the transformations found in
+// those functions, so that an unchanged function is not analyzed again.
+// Shared by all workers of a run; every method is thread-safe.
+class DecisionStore {
+public:
+    // Loads path if it was written by the same toolIdentity.
+    DecisionStore(std::string path, uint64_t sizeLimitBytes, std::string toolIdentity);
+
+    std::optional<std::vector<StoredDecision>> lookup(uint64_t fingerprint);
+    void record(uint64_t fingerprint, std::vector<StoredDecision> decisions);
+
+    // Write the store back, keeping the most recently used entries that fit
+    // the size limit
+    void save() const;
+
+private:
+    struct Entry {
+        std::vector<StoredDecision> decisions;
+        int64_t lastUsed;
+    };
+
+    void load();
+
+    std::string path_;
+    uint64_t sizeLimitBytes_;
+    std::string toolIdentity_;
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, Entry> entries_;
+    bool changed_;
+};
+
+} // namespace move_optimizer
+
+#endif // DECISION_STORE_H
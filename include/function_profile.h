@@ -0,0 +1,46 @@
+#ifndef FUNCTION_PROFILE_H
+#define FUNCTION_PROFILE_H
+
+#include <clang/AST/Decl.h>
+#include <clang/AST/Mangle.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+#include <cstdint>
+#include <optional>
+
+namespace move_optimizer {
+
+// Execution counts per function, read from one of:
+//   - a plain list of "<function> <count>" lines, where function is a
+//     mangled or qualified name and # starts a comment
+//   - an llvm-profdata sample profile in text form ("<name>:<total>:<head>")
+//   - an llvm-profdata instrumentation profile in text form; a function
+//     counts as often as its hottest counter
+// Read-only once loaded, so it can be shared between workers.
+class FunctionProfile {
+public:
+    // Nothing if path cannot be read or parsed; the reason goes to err.
+    static std::optional<FunctionProfile> load(llvm::StringRef path, llvm::raw_ostream& err);
+
+    // Count of function, looked up by mangled and then by qualified name.
+    // Constructors and destructors count as their hottest symbol, and
+    // clone suffixes such as ".llvm.123" are ignored. Functions missing from
+    // the profile count 0.
+    uint64_t countFor(const clang::FunctionDecl* function, clang::MangleContext& mangler) const;
+
+    // Identifies the contents, for cache keys
+    uint64_t getHash() const { return hash_; }
+
+private:
+    bool parseInstrumentationText(llvm::StringRef text);
+    bool parseSampleOrPlainText(llvm::StringRef text);
+    void add(llvm::StringRef name, uint64_t count);
+
+    llvm::StringMap<uint64_t> counts_;
+    uint64_t hash_ = 0;
+};
+
+} // namespace move_optimizer
+
+#endif // FUNCTION_PROFILE_H
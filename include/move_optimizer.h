@@ -3,6 +3,7 @@
 
 #include "ast_visitor.h"
 #include "code_transformer.h"
+#include "function_profile.h"
 #include <clang/AST/ASTContext.h>
 #include <clang/Rewrite/Core/Rewriter.h>
 #include <memory>
@@ -13,21 +14,71 @@ namespace move_optimizer {
 
 class MoveOptimizer {
 public:
-    MoveOptimizer(clang::ASTContext& context, clang::Rewriter& rewriter);
+    // rewriter may be null when only the replacements are wanted.
+    MoveOptimizer(clang::ASTContext& context, clang::Rewriter* rewriter);
     ~MoveOptimizer();
 
+    // Reuse decisions for unchanged functions from store (may be null)
+    void setDecisionStore(DecisionStore* store) { decisionStore_ = store; }
+
+    // Also edit non-system headers below root (see CodeTransformer)
+    void setHeaderRoot(std::string root) { transformer_->setHeaderRoot(std::move(root)); }
+
+    // Leave moves that avoid a copy cheaper than minCost alone
+    void setMinCopyCost(uint64_t minCost) { minCopyCost_ = minCost; }
+
+    // Also turn inserts into these user containers into emplaces
+    void setEmplaceContainers(std::vector<std::string> names) {
+        emplaceContainers_ = std::move(names);
+    }
+
+    // Look for const& sink parameters; in Report mode they are only listed
+    void setSinkParams(SignatureChanges mode) { sinkParams_ = mode; }
+
+    // Look for read-only by-value parameters; in Report mode they are only
+    // listed
+    void setReadOnlyParams(SignatureChanges mode) { readOnlyParams_ = mode; }
+
+    // Look up the execution count of each candidate's function in profile
+    // (may be null) and leave moves in functions run fewer than minCount
+    // times alone
+    void setProfile(const FunctionProfile* profile, uint64_t minCount) {
+        profile_ = profile;
+        minFunctionCount_ = minCount;
+    }
+
     // Process AST and collect optimization opportunities
     bool processAST(clang::ASTContext& context);
     
     // Apply transformations
     bool applyTransformations();
 
+    // Everything processAST found, including moves below the cost threshold
+    const std::vector<Transformation>& getTransformations() const { return transformations_; }
+
+    // Counters collected by processAST and applyTransformations
+    AnalysisStats getAnalysisStats() const;
+
+    // Edits made by applyTransformations, for replay without re-analysis
+    const FileEdits& getReplacements() const;
+    bool hasCompleteReplacements() const;
+
 private:
     clang::ASTContext& context_;
-    clang::Rewriter& rewriter_;
+    clang::Rewriter* rewriter_;
     std::unique_ptr<ASTVisitor> astVisitor_;
     std::unique_ptr<CodeTransformer> transformer_;
     std::vector<Transformation> transformations_;
+    DecisionStore* decisionStore_;
+    uint64_t minCopyCost_;
+    const FunctionProfile* profile_;
+    uint64_t minFunctionCount_;
+    std::vector<std::string> emplaceContainers_;
+    SignatureChanges sinkParams_;
+    SignatureChanges readOnlyParams_;
+
+    bool isProposalOnly(const Transformation& transformation) const;
+    void holdBackUnsafeSignatureChanges(clang::ASTContext& context);
 };
 
 } // namespace move_optimizer
@@ -0,0 +1,167 @@
+#ifndef OPTIMIZER_ACTION_H
+#define OPTIMIZER_ACTION_H
+
+#include "ast_visitor.h"
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <clang/Frontend/Utils.h>
+#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Tooling/Core/Replacement.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace move_optimizer {
+
+class DecisionStore;
+class FunctionProfile;
+
+// Where optimized files are written
+struct OutputOptions {
+    std::string outputFile;     // -o, single input only
+    std::string outputDir;      // --out-dir
+    bool inPlace = false;       // --in-place, overwrite the input itself
+};
+
+// Merge per-file statuses the way ClangTool::run does: 1 when a file failed,
+// 2 when a file was skipped.
+int combineStatus(int current, int next);
+
+// Output path for an input file
+std::string outputPathFor(const OutputOptions& options, llvm::StringRef inputFile);
+
+// Replace path with what write produces, through a temporary file that is
+// renamed over it. Creates the parent directory if needed. Adds the size of
+// the file to *bytesWritten when given.
+bool writeFileAtomically(llvm::StringRef path,
+                         llvm::function_ref<void(llvm::raw_ostream&)> write,
+                         llvm::raw_ostream& err, uint64_t* bytesWritten = nullptr);
+
+// Write mainFile with those of edits that belong to it applied. Nothing is
+// written for a file without edits unless -o names the output. Returns false
+// if the edits no longer apply to the file.
+bool writeEditedFile(const OutputOptions& options, llvm::StringRef mainFile,
+                     const FileEdits& edits,
+                     llvm::raw_ostream& out, llvm::raw_ostream& err,
+                     uint64_t* bytesWritten = nullptr);
+
+// Edits to headers under --header-root, gathered from every unit that
+// includes them so that each header is rewritten once at the end.
+class HeaderEditCollector {
+public:
+    // Keep the edits of edits that belong to files other than mainFile.
+    // Paths must be absolute. Safe to call from several workers.
+    void add(llvm::StringRef mainFile, const FileEdits& edits);
+
+    // Write each header with its edits applied. Identical edits from
+    // different units count once; a header whose edits conflict is left
+    // unchanged. Returns the status in the same form as ClangTool::run.
+    int write(const OutputOptions& options, llvm::raw_ostream& out, llvm::raw_ostream& err,
+              uint64_t* bytesWritten = nullptr);
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::set<clang::tooling::Replacement>> edits_;
+};
+
+// What a run over one unit produced besides its output file
+struct UnitRecord {
+    std::vector<std::string> dependencies;  // Only with collectDependencies
+    FileEdits edits;
+    bool complete = false;                  // Every edit made it into edits
+};
+
+// Function bodies the parser may skip. Only main-file code is ever rewritten,
+// so bodies elsewhere are needed for diagnostics only.
+enum class BodySkipping {
+    None,
+    SystemHeaders,      // Bodies in system headers
+    Headers             // Bodies outside the main file
+};
+
+// Whether policy lets the parser skip the body of decl
+bool shouldSkipFunctionBody(BodySkipping policy, const clang::Decl* decl);
+
+// A move the analysis found, for --report-candidates
+struct CandidateReport {
+    std::string location;       // file:line:column
+    std::string kind;           // "argument", "return", "emplace" and so on
+    std::string function;
+    std::string expression;     // Source text of the moved value
+    uint64_t copyCost = 0;
+    std::optional<uint64_t> executionCount;    // Only with a profile
+    const char* skipped = nullptr;  // Why the move was not made, if it was not
+
+    // Copy cost, times the execution count when there is one
+    uint64_t weight() const;
+};
+
+// Print candidates ranked by weight, heaviest first. The same candidate
+// reported by several units is printed once.
+void printCandidateReport(std::vector<CandidateReport> candidates, llvm::raw_ostream& os);
+
+struct ActionConfig {
+    const OutputOptions* output = nullptr;  // Null keeps the edits in record only
+    UnitRecord* record = nullptr;
+    bool collectDependencies = false;
+    DecisionStore* decisionStore = nullptr;
+    BodySkipping skipBodies = BodySkipping::None;
+    std::string headerRoot;                 // Real path; empty edits the main file only
+    uint64_t minCopyCost = 0;
+    const FunctionProfile* profile = nullptr;
+    uint64_t minFunctionCount = 0;          // Needs profile
+    std::vector<std::string> emplaceContainers;
+    SignatureChanges sinkParams = SignatureChanges::Off;
+    SignatureChanges readOnlyParams = SignatureChanges::Off;
+    std::vector<CandidateReport>* candidates = nullptr;
+};
+
+// Runs the optimizer over one translation unit
+class MoveOptimizerAction : public clang::ASTFrontendAction {
+public:
+    MoveOptimizerAction(llvm::raw_ostream& out, llvm::raw_ostream& err,
+                        AnalysisStats& stats, ActionConfig config);
+
+    bool BeginSourceFileAction(clang::CompilerInstance& CI) override;
+    std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance& CI,
+                                                          llvm::StringRef file) override;
+    void EndSourceFileAction() override;
+
+private:
+    std::unique_ptr<clang::Rewriter> rewriter_;
+    llvm::raw_ostream& out_;
+    llvm::raw_ostream& err_;
+    AnalysisStats& stats_;
+    ActionConfig config_;
+    std::shared_ptr<clang::DependencyCollector> dependencies_;
+};
+
+class MoveOptimizerActionFactory : public clang::tooling::FrontendActionFactory {
+public:
+    MoveOptimizerActionFactory(llvm::raw_ostream& out, llvm::raw_ostream& err,
+                               AnalysisStats& stats, ActionConfig config)
+        : out_(out), err_(err), stats_(stats), config_(config) {}
+
+    std::unique_ptr<clang::FrontendAction> create() override {
+        return std::make_unique<MoveOptimizerAction>(out_, err_, stats_, config_);
+    }
+
+private:
+    llvm::raw_ostream& out_;
+    llvm::raw_ostream& err_;
+    AnalysisStats& stats_;
+    ActionConfig config_;
+};
+
+} // namespace move_optimizer
+
+#endif // OPTIMIZER_ACTION_H
@@ -0,0 +1,59 @@
+#ifndef PREAMBLE_SERVER_H
+#define PREAMBLE_SERVER_H
+
+#include "ast_visitor.h"
+#include "optimizer_action.h"
+#include <clang/Frontend/PrecompiledPreamble.h>
+#include <clang/Tooling/CompilationDatabase.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace move_optimizer {
+
+// Long-running optimizer that keeps a precompiled preamble per compile
+// command and answers requests on a local Unix socket. Only the part of a
+// file after its #include block is parsed again while the preamble is warm.
+class PreambleServer {
+public:
+    // Each file is optimized with settings; its output and record are
+    // replaced by the server's own.
+    PreambleServer(const clang::tooling::CompilationDatabase& compilations,
+                   const ActionConfig& settings, size_t maxPreambles = 16);
+
+    // Serve until a client asks for shutdown. Returns the exit status.
+    int serve(llvm::StringRef socketPath);
+
+    const AnalysisStats& getStats() const { return stats_; }
+
+private:
+    struct CachedPreamble {
+        std::string key;
+        std::unique_ptr<clang::PrecompiledPreamble> preamble;
+    };
+
+    // Optimize one file and encode the reply
+    std::string optimize(llvm::StringRef file);
+    clang::PrecompiledPreamble* findPreamble(const std::string& key);
+    void storePreamble(const std::string& key, std::unique_ptr<clang::PrecompiledPreamble> preamble);
+
+    const clang::tooling::CompilationDatabase& compilations_;
+    ActionConfig settings_;
+    size_t maxPreambles_;
+    std::shared_ptr<clang::PCHContainerOperations> pchOperations_;
+    std::list<CachedPreamble> preambles_;    // Most recently used first
+    AnalysisStats stats_;
+};
+
+// Send each file to the server at socketPath and write its output locally.
+// Returns the combined status in the same form as ClangTool::run.
+int runClient(llvm::StringRef socketPath, llvm::ArrayRef<std::string> files,
+              const OutputOptions& output, bool shutdownServer);
+
+} // namespace move_optimizer
+
+#endif // PREAMBLE_SERVER_H
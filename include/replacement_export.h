@@ -0,0 +1,28 @@
+#ifndef REPLACEMENT_EXPORT_H
+#define REPLACEMENT_EXPORT_H
+
+#include "ast_visitor.h"
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+#include <string>
+
+namespace move_optimizer {
+
+// How --export-replacements hands edits to other tools
+enum class ExportFormat {
+    Yaml,       // One clang-apply-replacements file per unit in a directory
+    Jsonl       // One JSON object per edit in a single stream
+};
+
+// Write the edits of the unit mainFile into directory as a file that
+// clang-apply-replacements accepts. Units without edits get no file.
+bool exportReplacementsYaml(llvm::StringRef directory, llvm::StringRef mainFile,
+                            const FileEdits& edits, llvm::raw_ostream& err);
+
+// JSON lines for the edits of the unit mainFile, newline terminated
+std::string formatReplacementsJsonl(llvm::StringRef mainFile,
+                                    const FileEdits& edits);
+
+} // namespace move_optimizer
+
+#endif // REPLACEMENT_EXPORT_H
@@ -0,0 +1,63 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "ast_visitor.h"
+#include <clang/Tooling/CompilationDatabase.h>
+#include <clang/Tooling/Core/Replacement.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace move_optimizer {
+
+// On-disk cache of per-translation-unit results.
+//
+// An entry is keyed on the compile command (which names the main file) and
+// records every file the unit read together with a hash of its contents, plus
+// the edits the run produced. A lookup only hits when every recorded file
+// still hashes the same, so an unchanged unit can be skipped before it is
+// parsed.
+class ResultCache {
+public:
+    // toolIdentity should change whenever the optimizer itself changes.
+    ResultCache(std::string directory, uint64_t sizeLimitBytes, std::string toolIdentity);
+
+    // Edits recorded for an unchanged unit, or nothing on a miss
+    std::optional<FileEdits> lookup(
+        const clang::tooling::CompileCommand& command) const;
+
+    // Record the result of a successful run over the unit
+    void store(const clang::tooling::CompileCommand& command,
+               const std::vector<std::string>& dependencies,
+               const FileEdits& edits) const;
+
+    // Drop least recently used entries until the cache fits its size limit
+    void prune() const;
+
+private:
+    std::string entryPath(const clang::tooling::CompileCommand& command) const;
+
+    std::string directory_;
+    uint64_t sizeLimitBytes_;
+    std::string toolIdentity_;
+};
+
+// Resolve path against the working directory of a compile command
+std::string absolutePathFor(const clang::tooling::CompileCommand& command, llvm::StringRef path);
+
+// Text encoding of one edit, shared by cache entries and the server protocol:
+//   edit <offset> <length> <pathSize> <textSize>\n<path><text>\n
+void writeEdit(llvm::raw_ostream& os, llvm::StringRef path,
+               const clang::tooling::Replacement& edit);
+
+// Decode an edit whose first line, without the "edit " prefix, is line and
+// whose payload starts at cursor. Advances cursor past the record.
+bool readEdit(llvm::StringRef line, llvm::StringRef& cursor,
+              FileEdits& edits);
+
+} // namespace move_optimizer
+
+#endif // RESULT_CACHE_H
@@ -1,17 +1,268 @@
 #include "ast_visitor.h"
+#include "decision_store.h"
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/Expr.h>
 #include <clang/AST/ExprCXX.h>
 #include <clang/AST/DeclCXX.h>
 #include <clang/AST/Decl.h>
+#include <clang/AST/ODRHash.h>
+#include <clang/AST/StmtCXX.h>
 #include <clang/Basic/SourceManager.h>
-#include <queue>
-#include <unordered_set>
+#include <clang/Lex/Lexer.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <llvm/Support/xxhash.h>
+#include <algorithm>
+#include <cstdint>
 
 namespace move_optimizer {
 
+namespace {
+
+// Liveness sets are plain word arrays carved out of the function arena.
+using BitWord = uint64_t;
+constexpr unsigned BitsPerWord = 64;
+
+void setBit(BitWord* words, unsigned bit) {
+    words[bit / BitsPerWord] |= BitWord(1) << (bit % BitsPerWord);
+}
+
+void resetBit(BitWord* words, unsigned bit) {
+    words[bit / BitsPerWord] &= ~(BitWord(1) << (bit % BitsPerWord));
+}
+
+bool testBit(const BitWord* words, unsigned bit) {
+    return (words[bit / BitsPerWord] >> (bit % BitsPerWord)) & 1;
+}
+
+// dst |= src, returning whether dst changed.
+bool unionInto(BitWord* dst, const BitWord* src, unsigned numWords) {
+    BitWord changed = 0;
+    for (unsigned i = 0; i < numWords; ++i) {
+        const BitWord merged = dst[i] | src[i];
+        changed |= merged ^ dst[i];
+        dst[i] = merged;
+    }
+    return changed != 0;
+}
+
+// Adds the time until the end of the scope to *total, if there is one.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(std::chrono::nanoseconds* total) : total_(total) {
+        if (total_) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+    ~PhaseTimer() {
+        if (total_) {
+            *total_ += std::chrono::steady_clock::now() - start_;
+        }
+    }
+
+private:
+    std::chrono::nanoseconds* total_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Weights of the copy cost model, in the unit of one byte copied. A heap
+// allocation with its copy is taken to cost as much as copying 64 bytes, and
+// a container of elements that own memory to hold 16 of them.
+constexpr uint64_t AllocationCost = 64;
+constexpr uint64_t SharedCopyCost = 16;     // Atomic reference count update
+constexpr uint64_t ElementsPerContainer = 16;
+constexpr unsigned MaxCostDepth = 4;
+
+enum class Ownership {
+    None,
+    Buffer,         // One owned allocation: strings, std::function
+    Container,      // Owned elements
+    Shared          // Shared ownership: copies update a reference count
+};
+
+// What a standard library type owns
+Ownership standardOwnership(const clang::CXXRecordDecl* record) {
+    if (!record->isInStdNamespace() || !record->getIdentifier()) {
+        return Ownership::None;
+    }
+    return llvm::StringSwitch<Ownership>(record->getName())
+        .Cases("basic_string", "function", Ownership::Buffer)
+        .Case("shared_ptr", Ownership::Shared)
+        .Cases("vector", "deque", "list", "forward_list", Ownership::Container)
+        .Cases("map", "multimap", "set", "multiset", Ownership::Container)
+        .Cases("unordered_map", "unordered_multimap", "unordered_set", "unordered_multiset",
+               Ownership::Container)
+        .Default(Ownership::None);
+}
+
+// Standard containers whose inserts have an emplace counterpart
+bool isStandardContainer(const clang::CXXRecordDecl* record) {
+    if (!record->isInStdNamespace() || !record->getIdentifier()) {
+        return false;
+    }
+    return llvm::StringSwitch<bool>(record->getName())
+        .Cases("vector", "deque", "list", "forward_list", true)
+        .Cases("stack", "queue", "priority_queue", true)
+        .Cases("set", "multiset", "unordered_set", "unordered_multiset", true)
+        .Cases("map", "multimap", "unordered_map", "unordered_multimap", true)
+        .Default(false);
+}
+
+// The key type of a std::map or std::unordered_map, which have try_emplace
+std::optional<clang::QualType> uniqueMapKeyType(const clang::CXXRecordDecl* record) {
+    const auto* map = llvm::dyn_cast<clang::ClassTemplateSpecializationDecl>(record);
+    if (!map || !map->isInStdNamespace() || !map->getIdentifier() ||
+        (map->getName() != "map" && map->getName() != "unordered_map") ||
+        map->getTemplateArgs().size() == 0 ||
+        map->getTemplateArgs()[0].getKind() != clang::TemplateArgument::Type) {
+        return std::nullopt;
+    }
+    return map->getTemplateArgs()[0].getAsType();
+}
+
+// Whether arg is passed on unchanged by a forwarding reference. Braced
+// lists and overloaded names cannot be deduced, bit-fields cannot be bound,
+// and a literal 0 stops being a null pointer.
+bool isForwardable(const clang::Expr* arg) {
+    if (arg->refersToBitField()) {
+        return false;
+    }
+    if (const auto* cast = clang::dyn_cast<clang::ImplicitCastExpr>(arg)) {
+        if (cast->getCastKind() == clang::CK_NullToPointer) {
+            return false;
+        }
+    }
+    const clang::Expr* value = arg->IgnoreImplicit();
+    if (clang::isa<clang::InitListExpr>(value)) {
+        return false;
+    }
+    if (const auto* addressOf = clang::dyn_cast<clang::UnaryOperator>(value->IgnoreParens())) {
+        if (addressOf->getOpcode() == clang::UO_AddrOf) {
+            value = addressOf->getSubExpr();
+        }
+    }
+    const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(value->IgnoreParenImpCasts());
+    return !ref || !clang::isa<clang::FunctionDecl>(ref->getDecl()) ||
+           !ref->hadMultipleCandidates();
+}
+
+bool sameType(clang::QualType lhs, clang::QualType rhs) {
+    return lhs.getCanonicalType().getUnqualifiedType() ==
+           rhs.getCanonicalType().getUnqualifiedType();
+}
+
+// Records the parent of every statement below root, and the variable
+// references among them.
+void mapParents(const clang::Stmt* root,
+                llvm::DenseMap<const clang::Stmt*, const clang::Stmt*>& parents,
+                llvm::SmallVectorImpl<const clang::DeclRefExpr*>& refs) {
+    llvm::SmallVector<const clang::Stmt*, 32> pending;
+    pending.push_back(root);
+    while (!pending.empty()) {
+        const clang::Stmt* stmt = pending.pop_back_val();
+        if (const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(stmt)) {
+            refs.push_back(ref);
+        }
+        for (const clang::Stmt* child : stmt->children()) {
+            if (child) {
+                parents[child] = stmt;
+                pending.push_back(child);
+            }
+        }
+    }
+}
+
+// The element a range-for variable is initialized from, with only the
+// const added on the way stripped
+const clang::Expr* loopElement(const clang::CXXConstructExpr* construct) {
+    const clang::Expr* element = construct->getArg(0)->IgnoreParens();
+    while (const auto* cast = clang::dyn_cast<clang::ImplicitCastExpr>(element)) {
+        if (cast->getCastKind() != clang::CK_NoOp) {
+            break;
+        }
+        element = cast->getSubExpr()->IgnoreParens();
+    }
+    return element;
+}
+
+} // namespace
+
+llvm::StringRef emplaceCounterpart(llvm::StringRef method) {
+    return llvm::StringSwitch<llvm::StringRef>(method)
+        .Case("push_back", "emplace_back")
+        .Case("push_front", "emplace_front")
+        .Cases("push", "insert", "emplace")
+        .Default("");
+}
+
 ASTVisitor::ASTVisitor(clang::ASTContext& context)
-    : context_(context), currentFunction_(nullptr) {
+    : context_(context), decisionStore_(nullptr), phaseTimes_(nullptr),
+      sinkParams_(SignatureChanges::Off), readOnlyParams_(SignatureChanges::Off),
+      currentFunction_(nullptr), currentFullExpr_(nullptr) {
+}
+
+bool ASTVisitor::TraverseDecl(clang::Decl* decl) {
+    auto* function = llvm::dyn_cast_or_null<clang::FunctionDecl>(decl);
+    // One --time-trace span per function definition
+    std::optional<llvm::TimeTraceScope> span;
+    if (function && function->doesThisDeclarationHaveABody() && llvm::timeTraceProfilerEnabled()) {
+        span.emplace("AnalyzeFunction", function->getQualifiedNameAsString());
+    }
+
+    // Only main-file decisions are ever applied, so only those are worth
+    // storing.
+    if (!decisionStore_ || !function || !function->hasBody() ||
+        !function->isThisDeclarationADefinition() ||
+        !context_.getSourceManager().isInMainFile(function->getLocation())) {
+        return Base::TraverseDecl(decl);
+    }
+
+    std::optional<uint64_t> fingerprint = fingerprintFunction(function);
+    if (!fingerprint) {
+        return Base::TraverseDecl(decl);
+    }
+    if (replayDecisions(function, *fingerprint)) {
+        return true;
+    }
+
+    const size_t firstTransformation = transformations_.size();
+    if (!Base::TraverseDecl(decl)) {
+        return false;
+    }
+    recordDecisions(function, *fingerprint, firstTransformation);
+    return true;
+}
+
+bool ASTVisitor::TraverseStmt(clang::Stmt* stmt, DataRecursionQueue* queue) {
+    // The outermost expression is traversed without the caller's queue so
+    // that its subexpressions are done before it stops being current. A
+    // statement inside an expression, such as a lambda body, starts new
+    // full-expressions.
+    const bool isExpr = clang::isa_and_nonnull<clang::Expr>(stmt);
+    if (!stmt || isExpr == (currentFullExpr_ != nullptr)) {
+        return Base::TraverseStmt(stmt, queue);
+    }
+    const clang::Expr* enclosing = currentFullExpr_;
+    currentFullExpr_ = isExpr ? clang::cast<clang::Expr>(stmt) : nullptr;
+    const bool result = Base::TraverseStmt(stmt);
+    currentFullExpr_ = enclosing;
+    return result;
+}
+
+bool ASTVisitor::TraverseConstructorInitializer(clang::CXXCtorInitializer* init) {
+    if (!Base::TraverseConstructorInitializer(init)) {
+        return false;
+    }
+
+    PhaseTimer timer(phaseTimes_ ? &phaseTimes_->lastUseQueries : nullptr);
+    const clang::DeclRefExpr* ref = getMovableInitializerSource(init);
+    if (ref && isLastUseInCurrentFunction(ref)) {
+        addTransformation(Transformation::CONSTRUCTOR_INIT_MOVE, init->getSourceLocation(),
+                          ref->getSourceRange(), ref->getType());
+    }
+
+    return true;
 }
 
 bool ASTVisitor::VisitFunctionDecl(clang::FunctionDecl* decl) {
@@ -20,7 +271,10 @@ bool ASTVisitor::VisitFunctionDecl(clang::FunctionDecl* decl) {
     }
 
     currentFunction_ = decl;
+    ++stats_.functionsSeen;
     collectUsesForCurrentFunction();
+    findSinkParams();
+    findReadOnlyParams();
     return true;
 }
 
@@ -29,14 +283,12 @@ bool ASTVisitor::VisitCallExpr(clang::CallExpr* expr) {
         return true;
     }
 
+    PhaseTimer timer(phaseTimes_ ? &phaseTimes_->lastUseQueries : nullptr);
     for (unsigned i = 0; i < expr->getNumArgs(); ++i) {
-        clang::Expr* arg = ignoreImplicit(expr->getArg(i));
-        if (isCopyOperation(arg) && isSafeToMove(arg, expr)) {
-            transformations_.emplace_back(
-                Transformation::FUNCTION_ARG_MOVE,
-                expr->getLocation(),
-                arg->getSourceRange()
-            );
+        const clang::DeclRefExpr* ref = getMovableArgument(expr, i);
+        if (ref && isLastUseInCurrentFunction(ref)) {
+            addTransformation(Transformation::FUNCTION_ARG_MOVE, expr->getExprLoc(),
+                              ref->getSourceRange(), ref->getType());
         }
     }
 
@@ -48,47 +300,101 @@ bool ASTVisitor::VisitReturnStmt(clang::ReturnStmt* stmt) {
         return true;
     }
 
-    clang::Expr* retValue = ignoreImplicit(stmt->getRetValue());
-    const auto* declRef = clang::dyn_cast<clang::DeclRefExpr>(retValue);
-    if (!declRef) {
+    PhaseTimer timer(phaseTimes_ ? &phaseTimes_->lastUseQueries : nullptr);
+    clang::CXXConstructExpr* construct = nullptr;
+    clang::DeclRefExpr* declRef = getReturnedVariable(stmt->getRetValue(), construct);
+    if (!declRef || !isSafeToMove(declRef, stmt)) {
+        return true;
+    }
+
+    // By-value params are never elided, so moving them is always safe. A
+    // local is only moved where the return would copy it otherwise.
+    if (clang::isa<clang::ParmVarDecl>(declRef->getDecl()) || returnCopiesLocal(stmt, construct)) {
+        addTransformation(Transformation::RETURN_VALUE_MOVE, stmt->getReturnLoc(),
+                          declRef->getSourceRange(), declRef->getType());
+    }
+
+    return true;
+}
+
+bool ASTVisitor::VisitCXXOperatorCallExpr(clang::CXXOperatorCallExpr* expr) {
+    if (!expr) {
         return true;
     }
 
-    // Keep return optimization conservative: only by-value params.
-    const auto* param = clang::dyn_cast<clang::ParmVarDecl>(declRef->getDecl());
-    if (!param) {
+    PhaseTimer timer(phaseTimes_ ? &phaseTimes_->lastUseQueries : nullptr);
+    const clang::DeclRefExpr* ref = getMovableAssignmentSource(expr);
+    if (ref && isLastUseInCurrentFunction(ref)) {
+        addTransformation(Transformation::VARIABLE_ASSIGNMENT_MOVE, expr->getOperatorLoc(),
+                          ref->getSourceRange(), ref->getType());
+    }
+
+    return true;
+}
+
+bool ASTVisitor::VisitVarDecl(clang::VarDecl* decl) {
+    if (!decl) {
         return true;
     }
 
-    if (isCopyOperation(retValue) && isSafeToMove(retValue, stmt)) {
-        transformations_.emplace_back(
-            Transformation::RETURN_VALUE_MOVE,
-            stmt->getReturnLoc(),
-            retValue->getSourceRange()
-        );
+    PhaseTimer timer(phaseTimes_ ? &phaseTimes_->lastUseQueries : nullptr);
+    const clang::DeclRefExpr* ref = getMovableInitSource(decl);
+    if (ref && isLastUseInCurrentFunction(ref)) {
+        addTransformation(Transformation::VARIABLE_ASSIGNMENT_MOVE, decl->getLocation(),
+                          ref->getSourceRange(), ref->getType());
     }
 
     return true;
 }
 
-bool ASTVisitor::isCopyOperation(clang::Expr* expr) {
-    expr = ignoreImplicit(expr);
+bool ASTVisitor::VisitCXXMemberCallExpr(clang::CXXMemberCallExpr* expr) {
     if (!expr) {
-        return false;
+        return true;
     }
 
-    if (auto* construct = clang::dyn_cast<clang::CXXConstructExpr>(expr)) {
-        return construct->getConstructor()->isCopyConstructor();
+    Transformation::Type type;
+    const clang::Expr* temporary = getEmplaceableTemporary(expr, type);
+    if (temporary) {
+        const auto* member = clang::cast<clang::MemberExpr>(expr->getCallee()->IgnoreParens());
+        addTransformation(type, member->getMemberLoc(), temporary->getSourceRange(),
+                          temporary->getType());
     }
 
-    if (auto* declRef = clang::dyn_cast<clang::DeclRefExpr>(expr)) {
-        if (const auto* var = clang::dyn_cast<clang::VarDecl>(declRef->getDecl())) {
-            clang::QualType type = var->getType().getNonReferenceType();
-            return type->isRecordType();
-        }
+    return true;
+}
+
+clang::DeclRefExpr* ASTVisitor::getReturnedVariable(clang::Expr* value,
+                                                    clang::CXXConstructExpr*& construct) {
+    // Returning a variable of class type constructs the result from it, with
+    // nothing but implicit casts (derived-to-base, or the implicit move's
+    // cast to an xvalue) in between.
+    construct = clang::dyn_cast_or_null<clang::CXXConstructExpr>(ignoreImplicit(value));
+    if (!construct || construct->getNumArgs() == 0) {
+        return nullptr;
     }
+    if (construct->getNumArgs() > 1 &&
+        !clang::isa<clang::CXXDefaultArgExpr>(construct->getArg(1))) {
+        return nullptr;
+    }
+    return clang::dyn_cast<clang::DeclRefExpr>(construct->getArg(0)->IgnoreParenImpCasts());
+}
 
-    return false;
+bool ASTVisitor::returnCopiesLocal(const clang::ReturnStmt* stmt,
+                                   const clang::CXXConstructExpr* construct) {
+    // A moved NRVO candidate can no longer be constructed in place.
+    if (stmt->getNRVOCandidate()) {
+        return false;
+    }
+
+    // Where the implicit move applies, the constructor already takes an
+    // rvalue. Before C++20 it does not for a derived-to-base or converting
+    // return, which picks the copying constructor instead.
+    const clang::CXXConstructorDecl* ctor = construct->getConstructor();
+    if (ctor->getNumParams() == 0 ||
+        !ctor->getParamDecl(0)->getType()->isLValueReferenceType()) {
+        return false;
+    }
+    return hasMoveConstructor(construct->getType());
 }
 
 bool ASTVisitor::hasMoveConstructor(clang::QualType type) {
@@ -102,8 +408,13 @@ bool ASTVisitor::hasMoveConstructor(clang::QualType type) {
         return false;
     }
 
+    // An implicit move constructor is only declared once something uses it.
+    if (record->needsImplicitMoveConstructor()) {
+        return true;
+    }
+
     for (clang::CXXConstructorDecl* ctor : record->ctors()) {
-        if (ctor->isMoveConstructor()) {
+        if (ctor->isMoveConstructor() && !ctor->isDeleted()) {
             return true;
         }
     }
@@ -111,272 +422,1337 @@ bool ASTVisitor::hasMoveConstructor(clang::QualType type) {
     return false;
 }
 
-bool ASTVisitor::isSafeToMove(clang::Expr* expr, const clang::Stmt* context) {
-    expr = ignoreImplicit(expr);
-    if (!expr || !context) {
+bool ASTVisitor::hasMoveAssignment(clang::QualType type) {
+    const auto* record = type.getNonReferenceType()->getAsCXXRecordDecl();
+    if (!record || !record->hasDefinition()) {
         return false;
     }
 
-    if (!expr->isLValue()) {
-        return false;
+    // Like the move constructor, an implicit one is declared lazily.
+    if (record->needsImplicitMoveAssignment()) {
+        return true;
     }
 
-    auto* declRef = clang::dyn_cast<clang::DeclRefExpr>(expr);
-    if (!declRef) {
-        return false;
+    for (const clang::CXXMethodDecl* method : record->methods()) {
+        if (method->isMoveAssignmentOperator() && !method->isDeleted()) {
+            return true;
+        }
     }
 
-    const auto* var = clang::dyn_cast<clang::VarDecl>(declRef->getDecl());
+    return false;
+}
+
+bool ASTVisitor::isMovableVariable(const clang::DeclRefExpr* ref) {
+    const auto* var = clang::dyn_cast<clang::VarDecl>(ref->getDecl());
     if (!var) {
         return false;
     }
 
-    // Do not move globals/statics. We only reason about local state here.
+    // Only locals and by-value parameters that belong to the function being
+    // analyzed. Captures and lambda locals live in a different frame.
+    if (ref->refersToEnclosingVariableOrCapture() || var->getDeclContext() != currentFunction_) {
+        return false;
+    }
     if (!clang::isa<clang::ParmVarDecl>(var) && !var->hasLocalStorage()) {
         return false;
     }
 
-    clang::QualType type = expr->getType().getNonReferenceType();
-    if (!type->isRecordType() || type.isConstQualified()) {
+    clang::QualType type = var->getType();
+    if (type->isReferenceType() || !type->isRecordType() ||
+        type.isConstQualified() || type.isVolatileQualified()) {
         return false;
     }
 
-    if (!hasMoveConstructor(type)) {
-        return false;
+    return hasMoveConstructor(type);
+}
+
+const clang::DeclRefExpr* ASTVisitor::getMovableArgument(const clang::CallExpr* call,
+                                                         unsigned index) {
+    // A by-value parameter initialized from an lvalue shows up as a copy
+    // construction of the argument.
+    const auto* construct = clang::dyn_cast<clang::CXXConstructExpr>(
+        call->getArg(index)->IgnoreImplicit());
+    if (!construct || construct->getNumArgs() == 0 ||
+        !construct->getConstructor()->isCopyConstructor()) {
+        return nullptr;
     }
 
-    if (clang::isa<clang::ReturnStmt>(context)) {
-        return true;
+    const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(
+        construct->getArg(0)->IgnoreParenImpCasts());
+    if (!ref || !ref->isLValue() || !isMovableVariable(ref)) {
+        return nullptr;
     }
 
-    if (clang::isa<clang::CallExpr>(context)) {
-        const auto& sm = context_.getSourceManager();
-        return isLastUseInCurrentFunction(var, sm.getExpansionLoc(expr->getBeginLoc()));
+    // Argument evaluation order is unspecified, so a variable that the
+    // callee or another argument also reads cannot be moved from.
+    if (referencesVariable(call->getCallee(), ref->getDecl())) {
+        return nullptr;
     }
+    for (unsigned i = 0; i < call->getNumArgs(); ++i) {
+        if (i != index && referencesVariable(call->getArg(i), ref->getDecl())) {
+            return nullptr;
+        }
+    }
+
+    // The same goes for the rest of the full-expression, as in
+    // "outer(sink(v), v.size())".
+    if (currentFullExpr_ && isReferencedElsewhere(currentFullExpr_, ref)) {
+        return nullptr;
+    }
+
+    return ref;
+}
 
+bool ASTVisitor::isReferencedElsewhere(const clang::Stmt* stmt, const clang::DeclRefExpr* ref) {
+    llvm::SmallVector<const clang::Stmt*, 16> pending;
+    pending.push_back(stmt);
+    while (!pending.empty()) {
+        const clang::Stmt* current = pending.pop_back_val();
+        if (const auto* other = clang::dyn_cast<clang::DeclRefExpr>(current)) {
+            if (other != ref && other->getDecl() == ref->getDecl()) {
+                return true;
+            }
+        }
+        for (const clang::Stmt* child : current->children()) {
+            if (child) {
+                pending.push_back(child);
+            }
+        }
+    }
     return false;
 }
 
-bool ASTVisitor::isLastUseInCurrentFunction(const clang::VarDecl* var,
-                                            clang::SourceLocation useLoc) const {
-    if (!var || !currentFunctionCfg_ || !useLoc.isValid()) {
-        return false;
+const clang::DeclRefExpr* ASTVisitor::getMovableAssignmentSource(
+    const clang::CXXOperatorCallExpr* call) {
+    // A by-value operator= copies through its argument, which VisitCallExpr
+    // already handles; only the const& form is left.
+    const auto* method = clang::dyn_cast_or_null<clang::CXXMethodDecl>(call->getDirectCallee());
+    if (call->getOperator() != clang::OO_Equal || call->getNumArgs() != 2 || !method ||
+        !method->isCopyAssignmentOperator() ||
+        !method->getParamDecl(0)->getType()->isLValueReferenceType()) {
+        return nullptr;
     }
 
-    const UsePosition* current = findUsePosition(var, useLoc);
-    if (!current) {
-        return false;
+    const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(call->getArg(1)->IgnoreParenImpCasts());
+    if (!ref || !ref->isLValue() || !isMovableVariable(ref) ||
+        !hasMoveAssignment(context_.getRecordType(method->getParent()))) {
+        return nullptr;
     }
 
-    auto usesIt = variableUsePositions_.find(var);
-    if (usesIt == variableUsePositions_.end()) {
-        return false;
+    // a = a, or a.member = a, would read what it moved from.
+    if (referencesVariable(call->getArg(0), ref->getDecl())) {
+        return nullptr;
     }
 
-    for (const UsePosition& candidate : usesIt->second) {
-        if (candidate.location == current->location &&
-            candidate.blockId == current->blockId &&
-            candidate.elementIndex == current->elementIndex) {
-            continue;
-        }
-        if (canOccurAfter(*current, candidate)) {
-            return false;
-        }
+    // So would another operand of the full-expression, as in "f(b, a = b)",
+    // which may be evaluated after the assignment.
+    if (currentFullExpr_ && isReferencedElsewhere(currentFullExpr_, ref)) {
+        return nullptr;
     }
 
-    return true;
+    return ref;
 }
 
-void ASTVisitor::collectUsesForCurrentFunction() {
-    variableUsePositions_.clear();
-    cfgBlocksById_.clear();
-    currentFunctionCfg_.reset();
-
-    if (!currentFunction_ || !currentFunction_->hasBody()) {
-        return;
+const clang::DeclRefExpr* ASTVisitor::getMovableInitSource(const clang::VarDecl* var) {
+    // Init captures and default arguments are initialized elsewhere.
+    if (clang::isa<clang::ParmVarDecl>(var) || !var->hasLocalStorage() || var->isInitCapture() ||
+        var->getDeclContext() != currentFunction_ || var->getType()->isReferenceType()) {
+        return nullptr;
     }
 
-    clang::CFG::BuildOptions options;
-    options.AddImplicitDtors = true;
-    options.AddTemporaryDtors = true;
-    options.AddInitializers = true;
-    currentFunctionCfg_ = clang::CFG::buildCFG(
-        currentFunction_, currentFunction_->getBody(), &context_, options);
-    if (!currentFunctionCfg_) {
-        return;
+    const auto* construct = clang::dyn_cast_or_null<clang::CXXConstructExpr>(
+        var->getInit() ? var->getInit()->IgnoreImplicit() : nullptr);
+    if (!construct || construct->getNumArgs() != 1 ||
+        !construct->getConstructor()->isCopyConstructor()) {
+        return nullptr;
     }
 
-    class DeclRefCollector : public clang::RecursiveASTVisitor<DeclRefCollector> {
-    public:
-        DeclRefCollector(clang::SourceManager& sourceManager,
-                         std::vector<std::pair<const clang::VarDecl*, clang::SourceLocation>>& out)
-            : sourceManager_(sourceManager), out_(out) {
-        }
-
-        bool VisitDeclRefExpr(clang::DeclRefExpr* expr) {
-            if (!expr || !expr->getLocation().isValid()) {
-                return true;
-            }
-            const auto* var = clang::dyn_cast<clang::VarDecl>(expr->getDecl());
-            if (!var) {
-                return true;
-            }
-            out_.push_back({var, sourceManager_.getExpansionLoc(expr->getLocation())});
-            return true;
-        }
-
-    private:
-        clang::SourceManager& sourceManager_;
-        std::vector<std::pair<const clang::VarDecl*, clang::SourceLocation>>& out_;
-    };
+    const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(
+        construct->getArg(0)->IgnoreParenImpCasts());
+    if (!ref || !ref->isLValue() || !isMovableVariable(ref)) {
+        return nullptr;
+    }
 
-    clang::SourceManager& sm = context_.getSourceManager();
-    for (const clang::CFGBlock* block : *currentFunctionCfg_) {
-        if (!block) {
-            continue;
-        }
-        cfgBlocksById_[block->getBlockID()] = block;
+    return ref;
+}
 
-        unsigned elementIndex = 0;
-        for (const clang::CFGElement& element : *block) {
-            auto cfgStmt = element.getAs<clang::CFGStmt>();
-            if (!cfgStmt) {
-                ++elementIndex;
-                continue;
-            }
+const clang::DeclRefExpr* ASTVisitor::getMovableInitializerSource(
+    const clang::CXXCtorInitializer* init) {
+    // Implicit initializers have no text to rewrite.
+    if (!init->isWritten() || !(init->isAnyMemberInitializer() || init->isBaseInitializer())) {
+        return nullptr;
+    }
 
-            const clang::Stmt* stmt = cfgStmt->getStmt();
-            if (!stmt) {
-                ++elementIndex;
-                continue;
-            }
+    const auto* construct = clang::dyn_cast_or_null<clang::CXXConstructExpr>(
+        init->getInit() ? init->getInit()->IgnoreImplicit() : nullptr);
+    if (!construct || construct->getNumArgs() != 1 ||
+        !construct->getConstructor()->isCopyConstructor()) {
+        return nullptr;
+    }
 
-            std::vector<std::pair<const clang::VarDecl*, clang::SourceLocation>> refs;
-            DeclRefCollector collector(sm, refs);
-            collector.TraverseStmt(const_cast<clang::Stmt*>(stmt));
+    // Sink parameters only; locals cannot appear in an initializer.
+    const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(
+        construct->getArg(0)->IgnoreParenImpCasts());
+    if (!ref || !ref->isLValue() || !clang::isa<clang::ParmVarDecl>(ref->getDecl()) ||
+        !isMovableVariable(ref)) {
+        return nullptr;
+    }
 
-            for (const auto& [var, location] : refs) {
-                variableUsePositions_[var].push_back({block->getBlockID(), elementIndex, location});
-            }
+    return ref;
+}
 
-            ++elementIndex;
-        }
+bool ASTVisitor::isEmplaceContainer(const clang::CXXRecordDecl* record) const {
+    if (isStandardContainer(record)) {
+        return true;
     }
+    return !emplaceContainers_.empty() &&
+           llvm::is_contained(emplaceContainers_, record->getQualifiedNameAsString());
 }
 
-bool ASTVisitor::canOccurAfter(const UsePosition& current, const UsePosition& candidate) const {
-    if (!currentFunctionCfg_) {
-        return false;
+const clang::Expr* ASTVisitor::getEmplaceableTemporary(const clang::CXXMemberCallExpr* call,
+                                                       Transformation::Type& type) {
+    const clang::CXXMethodDecl* method = call->getMethodDecl();
+    const clang::CXXRecordDecl* record = call->getRecordDecl();
+    if (!method || !record || !method->getIdentifier() || call->getNumArgs() != 1 ||
+        !clang::isa<clang::MemberExpr>(call->getCallee()->IgnoreParens()) ||
+        !isEmplaceContainer(record)) {
+        return nullptr;
+    }
+    const llvm::StringRef counterpart = emplaceCounterpart(method->getName());
+    if (counterpart.empty() || record->lookup(&context_.Idents.get(counterpart)).empty()) {
+        return nullptr;
     }
 
-    const auto fromIt = cfgBlocksById_.find(current.blockId);
-    const auto toIt = cfgBlocksById_.find(candidate.blockId);
-    if (fromIt == cfgBlocksById_.end() || toIt == cfgBlocksById_.end()) {
-        return false;
+    // Either std::make_pair(k, v) into a map, or a temporary of exactly the
+    // type the insert takes, built with parentheses.
+    const clang::Expr* temporary = call->getArg(0)->IgnoreImplicit();
+    llvm::SmallVector<const clang::Expr*, 4> args;
+    const auto* makePair = clang::dyn_cast<clang::CallExpr>(temporary);
+    const clang::FunctionDecl* callee = makePair ? makePair->getDirectCallee() : nullptr;
+    if (callee && callee->isInStdNamespace() && callee->getIdentifier() &&
+        callee->getName() == "make_pair" && makePair->getNumArgs() == 2 &&
+        method->getName() == "insert" && isStandardContainer(record)) {
+        args.append(makePair->arg_begin(), makePair->arg_end());
+    } else {
+        const clang::CXXConstructExpr* construct = nullptr;
+        if (const auto* cast = clang::dyn_cast<clang::CXXFunctionalCastExpr>(temporary)) {
+            if (!cast->isListInitialization()) {
+                construct = clang::dyn_cast<clang::CXXConstructExpr>(
+                    cast->getSubExpr()->IgnoreImplicit());
+            }
+        } else {
+            construct = clang::dyn_cast<clang::CXXTemporaryObjectExpr>(temporary);
+        }
+        // The container constructs the element, so the constructor has to
+        // be public.
+        if (!construct || construct->isListInitialization() ||
+            construct->getConstructor()->getAccess() == clang::AS_private ||
+            construct->getConstructor()->getAccess() == clang::AS_protected ||
+            method->getNumParams() != 1 ||
+            !sameType(method->getParamDecl(0)->getType().getNonReferenceType(),
+                      construct->getType())) {
+            return nullptr;
+        }
+        for (const clang::Expr* arg : construct->arguments()) {
+            if (!clang::isa<clang::CXXDefaultArgExpr>(arg)) {
+                args.push_back(arg);
+            }
+        }
     }
 
-    if (current.blockId == candidate.blockId) {
-        if (candidate.elementIndex > current.elementIndex) {
-            return true;
+    // Inserting may reallocate before the element is built from arguments
+    // that still point into the container.
+    const clang::Expr* object = call->getImplicitObjectArgument()->IgnoreParenImpCasts();
+    const clang::ValueDecl* container = nullptr;
+    if (const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(object)) {
+        container = ref->getDecl();
+    } else if (const auto* member = clang::dyn_cast<clang::MemberExpr>(object)) {
+        container = member->getMemberDecl();
+    }
+    for (const clang::Expr* arg : args) {
+        if (!isForwardable(arg) || (container && referencesVariable(arg, container))) {
+            return nullptr;
         }
-        return blockCanReachItself(fromIt->second);
     }
 
-    return isReachable(fromIt->second, toIt->second);
+    // try_emplace skips building the value when the key exists, as insert
+    // does, but takes the key as the key type itself.
+    type = Transformation::EMPLACE_INSERT;
+    std::optional<clang::QualType> keyType = uniqueMapKeyType(record);
+    if (keyType && args.size() == 2 && method->getName() == "insert" &&
+        sameType(args[0]->IgnoreParenImpCasts()->getType(), *keyType) &&
+        !record->lookup(&context_.Idents.get("try_emplace")).empty()) {
+        type = Transformation::TRY_EMPLACE_INSERT;
+    }
+    return temporary;
 }
 
-bool ASTVisitor::isReachable(const clang::CFGBlock* from, const clang::CFGBlock* to) const {
-    if (!from || !to) {
-        return false;
-    }
-    if (from == to) {
+bool ASTVisitor::hasMoveCandidates(const clang::FunctionDecl* function) {
+    if (sinkParams_ != SignatureChanges::Off && isSignatureChangeable(function) &&
+        llvm::any_of(function->parameters(),
+                     [this](const clang::ParmVarDecl* param) { return isSinkParamType(param); })) {
         return true;
     }
-
-    std::queue<const clang::CFGBlock*> queue;
-    std::unordered_set<unsigned> visited;
-    visited.insert(from->getBlockID());
-    queue.push(from);
-
-    while (!queue.empty()) {
-        const clang::CFGBlock* current = queue.front();
-        queue.pop();
-
-        for (const clang::CFGBlock::AdjacentBlock succ : current->succs()) {
-            const clang::CFGBlock* succBlock = succ.getReachableBlock();
-            if (!succBlock) {
-                continue;
-            }
-            if (succBlock == to) {
+    if (const auto* ctor = clang::dyn_cast<clang::CXXConstructorDecl>(function)) {
+        for (const clang::CXXCtorInitializer* init : ctor->inits()) {
+            if (getMovableInitializerSource(init)) {
                 return true;
             }
-            if (visited.insert(succBlock->getBlockID()).second) {
-                queue.push(succBlock);
-            }
         }
     }
-
-    return false;
+    return hasMoveCandidates(function->getBody());
 }
 
-bool ASTVisitor::blockCanReachItself(const clang::CFGBlock* block) const {
-    if (!block) {
+bool ASTVisitor::isSignatureChangeable(const clang::FunctionDecl* function) {
+    // Overrides, templates and C linkage fix the signature, and the copy and
+    // move members would stop being copy and move members.
+    const auto* method = clang::dyn_cast<clang::CXXMethodDecl>(function);
+    if (function->isMain() || function->isExternC() || function->isOverloadedOperator() ||
+        function->getTemplatedKind() != clang::FunctionDecl::TK_NonTemplate ||
+        (method && (method->isVirtual() || method->getParent()->isDependentContext()))) {
         return false;
     }
+    if (const auto* ctor = clang::dyn_cast<clang::CXXConstructorDecl>(function)) {
+        if (ctor->isCopyOrMoveConstructor()) {
+            return false;
+        }
+    }
 
-    std::queue<const clang::CFGBlock*> queue;
-    std::unordered_set<unsigned> visited;
-
-    for (const clang::CFGBlock::AdjacentBlock succ : block->succs()) {
-        const clang::CFGBlock* succBlock = succ.getReachableBlock();
-        if (!succBlock) {
-            continue;
+    // An overload that takes T&& would make calls with rvalues ambiguous, so
+    // the function must be the only one of its name and arity. Copy and move
+    // constructors take the class itself and do not count.
+    const clang::FunctionDecl* canonical = function->getCanonicalDecl();
+    const clang::DeclContext* context = function->getDeclContext();
+    for (const clang::NamedDecl* found : context->lookup(function->getDeclName())) {
+        const clang::NamedDecl* underlying = found->getUnderlyingDecl();
+        if (const auto* pattern = clang::dyn_cast<clang::FunctionTemplateDecl>(underlying)) {
+            underlying = pattern->getTemplatedDecl();
         }
-        if (succBlock == block) {
-            return true;
+        const auto* other = clang::dyn_cast<clang::FunctionDecl>(underlying);
+        if (!other) {
+            return false;
         }
-        if (visited.insert(succBlock->getBlockID()).second) {
-            queue.push(succBlock);
+        const auto* otherCtor = clang::dyn_cast<clang::CXXConstructorDecl>(other);
+        if (other->getCanonicalDecl() == canonical ||
+            (otherCtor && otherCtor->isCopyOrMoveConstructor()) ||
+            other->getMinRequiredArguments() > function->getNumParams() ||
+            other->getNumParams() < function->getMinRequiredArguments()) {
+            continue;
         }
+        return false;
     }
+    return true;
+}
 
-    while (!queue.empty()) {
-        const clang::CFGBlock* current = queue.front();
-        queue.pop();
+bool ASTVisitor::isSinkParamType(const clang::ParmVarDecl* param) {
+    const clang::QualType type = param->getType();
+    if (!type->isLValueReferenceType() || type->isDependentType()) {
+        return false;
+    }
+    const clang::QualType pointee = type->getPointeeType();
+    if (!pointee.isConstQualified() || pointee.isVolatileQualified() ||
+        !pointee->isRecordType()) {
+        return false;
+    }
+    return hasMoveConstructor(pointee) && estimateCopyCost(pointee) > 0;
+}
 
-        for (const clang::CFGBlock::AdjacentBlock succ : current->succs()) {
-            const clang::CFGBlock* succBlock = succ.getReachableBlock();
-            if (!succBlock) {
-                continue;
+const clang::DeclRefExpr* ASTVisitor::findSinkUse(const clang::ParmVarDecl* param) {
+    const auto* ctor = clang::dyn_cast<clang::CXXConstructorDecl>(currentFunction_);
+    llvm::SmallVector<const clang::Stmt*, 32> pending;
+    pending.push_back(currentFunction_->getBody());
+    if (ctor) {
+        for (const clang::CXXCtorInitializer* init : ctor->inits()) {
+            if (init->isWritten() && init->getInit()) {
+                pending.push_back(init->getInit());
             }
-            if (succBlock == block) {
-                return true;
+        }
+    }
+
+    // The parameter has to be read exactly once.
+    const clang::DeclRefExpr* use = nullptr;
+    while (!pending.empty()) {
+        const clang::Stmt* stmt = pending.pop_back_val();
+        if (const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(stmt)) {
+            if (ref->getDecl() == param) {
+                if (use) {
+                    return nullptr;
+                }
+                use = ref;
             }
-            if (visited.insert(succBlock->getBlockID()).second) {
-                queue.push(succBlock);
+        }
+        for (const clang::Stmt* child : stmt->children()) {
+            if (child) {
+                pending.push_back(child);
             }
         }
     }
+    if (!use) {
+        return nullptr;
+    }
 
+    // That read copies it into a member: a member initializer, a copy
+    // assignment to a member or an insert into a member container.
+    auto isUse = [use](const clang::Expr* expr) { return expr->IgnoreParenImpCasts() == use; };
+    auto isOwnMember = [](const clang::Expr* expr) {
+        const auto* member = clang::dyn_cast<clang::MemberExpr>(expr->IgnoreParenImpCasts());
+        return member && clang::isa<clang::CXXThisExpr>(member->getBase()->IgnoreParenImpCasts());
+    };
+    if (ctor) {
+        for (const clang::CXXCtorInitializer* init : ctor->inits()) {
+            const auto* construct = clang::dyn_cast_or_null<clang::CXXConstructExpr>(
+                init->getInit() ? init->getInit()->IgnoreImplicit() : nullptr);
+            if (init->isWritten() && init->isAnyMemberInitializer() && construct &&
+                construct->getNumArgs() == 1 &&
+                construct->getConstructor()->isCopyConstructor() && isUse(construct->getArg(0))) {
+                return use;
+            }
+        }
+    }
+    pending.push_back(currentFunction_->getBody());
+    while (!pending.empty()) {
+        const clang::Stmt* stmt = pending.pop_back_val();
+        if (const auto* assign = clang::dyn_cast<clang::CXXOperatorCallExpr>(stmt)) {
+            const auto* method =
+                clang::dyn_cast_or_null<clang::CXXMethodDecl>(assign->getDirectCallee());
+            if (method && method->isCopyAssignmentOperator() && assign->getNumArgs() == 2 &&
+                isOwnMember(assign->getArg(0)) && isUse(assign->getArg(1))) {
+                return use;
+            }
+        } else if (const auto* call = clang::dyn_cast<clang::CXXMemberCallExpr>(stmt)) {
+            const clang::CXXMethodDecl* method = call->getMethodDecl();
+            if (method && method->getIdentifier() && call->getNumArgs() == 1 &&
+                !emplaceCounterpart(method->getName()).empty() && call->getRecordDecl() &&
+                isEmplaceContainer(call->getRecordDecl()) &&
+                isOwnMember(call->getImplicitObjectArgument()) && isUse(call->getArg(0))) {
+                return use;
+            }
+        }
+        for (const clang::Stmt* child : stmt->children()) {
+            if (child) {
+                pending.push_back(child);
+            }
+        }
+    }
+    return nullptr;
+}
+
+void ASTVisitor::findSinkParams() {
+    if (sinkParams_ == SignatureChanges::Off || !currentFunctionCfg_ ||
+        !isSignatureChangeable(currentFunction_)) {
+        return;
+    }
+
+    for (unsigned i = 0; i < currentFunction_->getNumParams(); ++i) {
+        const clang::ParmVarDecl* param = currentFunction_->getParamDecl(i);
+        if (!isSinkParamType(param)) {
+            continue;
+        }
+        // A use in a loop is not the last one.
+        const clang::DeclRefExpr* use = findSinkUse(param);
+        if (!use || !isLastUseInCurrentFunction(use)) {
+            continue;
+        }
+
+        const bool written = llvm::all_of(
+            currentFunction_->redecls(), [i](const clang::FunctionDecl* redecl) {
+                return redecl->getParamDecl(i)->getTypeSourceInfo() != nullptr;
+            });
+        if (!written) {
+            continue;
+        }
+
+        const clang::QualType valueType = param->getType()->getPointeeType();
+        if (sinkParams_ == SignatureChanges::Report) {
+            addTransformation(Transformation::SINK_PARAM_BY_VALUE, param->getLocation(),
+                              param->getTypeSourceInfo()->getTypeLoc().getSourceRange(),
+                              valueType);
+            continue;
+        }
+
+        // Every declaration takes the parameter by value, or none does; the
+        // transformer checks that all of them can be edited.
+        for (const clang::FunctionDecl* redecl : currentFunction_->redecls()) {
+            const clang::ParmVarDecl* declared = redecl->getParamDecl(i);
+            addTransformation(Transformation::SINK_PARAM_BY_VALUE, declared->getLocation(),
+                              declared->getTypeSourceInfo()->getTypeLoc().getSourceRange(),
+                              valueType);
+        }
+        addTransformation(Transformation::SINK_PARAM_MOVE, use->getLocation(),
+                          use->getSourceRange(), valueType);
+    }
+}
+
+bool ASTVisitor::isReadOnlyParamType(const clang::ParmVarDecl* param) {
+    const clang::QualType type = param->getType();
+    if (type->isReferenceType() || !type->isRecordType() || type->isDependentType() ||
+        type.isVolatileQualified()) {
+        return false;
+    }
+    return estimateCopyCost(type) > 0;
+}
+
+bool ASTVisitor::isReadOnlyUse(
+    const clang::DeclRefExpr* ref,
+    const llvm::DenseMap<const clang::Stmt*, const clang::Stmt*>& parents) {
+    // Anything that could modify the parameter, move from it, take its
+    // address or bind a non-const reference to it rules the change out, and
+    // so does anything not recognized here.
+    auto bindsReadOnly = [](clang::QualType param) {
+        return !param->isReferenceType() ||
+               (param->isLValueReferenceType() && param.getNonReferenceType().isConstQualified());
+    };
+    const clang::Stmt* child = ref;
+    while (true) {
+        auto found = parents.find(child);
+        const clang::Stmt* parent = found != parents.end() ? found->second : nullptr;
+        if (!parent) {
+            return false;
+        }
+
+        if (clang::isa<clang::ParenExpr>(parent)) {
+            child = parent;
+            continue;
+        }
+        if (const auto* cast = clang::dyn_cast<clang::ImplicitCastExpr>(parent)) {
+            switch (cast->getCastKind()) {
+                case clang::CK_LValueToRValue:
+                    return true;
+                case clang::CK_NoOp:
+                    // Now const, unless this is the implicit move of a return
+                    if (cast->isXValue()) {
+                        return false;
+                    }
+                    if (cast->getType().isConstQualified()) {
+                        return true;
+                    }
+                    child = parent;
+                    continue;
+                case clang::CK_DerivedToBase:
+                case clang::CK_UncheckedDerivedToBase:
+                    child = parent;
+                    continue;
+                default:
+                    return false;
+            }
+        }
+        if (const auto* member = clang::dyn_cast<clang::MemberExpr>(parent)) {
+            if (const auto* method = clang::dyn_cast<clang::CXXMethodDecl>(member->getMemberDecl())) {
+                return method->isConst() || method->isStatic();
+            }
+            child = parent;     // A field of the parameter
+            continue;
+        }
+        if (const auto* construct = clang::dyn_cast<clang::CXXConstructExpr>(parent)) {
+            for (unsigned i = 0; i < construct->getNumArgs(); ++i) {
+                if (construct->getArg(i) == child) {
+                    const clang::CXXConstructorDecl* ctor = construct->getConstructor();
+                    return i >= ctor->getNumParams() ||
+                           bindsReadOnly(ctor->getParamDecl(i)->getType());
+                }
+            }
+            return false;
+        }
+        if (const auto* call = clang::dyn_cast<clang::CallExpr>(parent)) {
+            const clang::FunctionDecl* callee = call->getDirectCallee();
+            if (!callee) {
+                return false;
+            }
+            // A member operator takes its object as the first argument.
+            const auto* method = clang::dyn_cast<clang::CXXMethodDecl>(callee);
+            const bool memberOperator = clang::isa<clang::CXXOperatorCallExpr>(call) && method &&
+                                        !method->isStatic();
+            for (unsigned i = 0; i < call->getNumArgs(); ++i) {
+                if (call->getArg(i) != child) {
+                    continue;
+                }
+                if (memberOperator && i == 0) {
+                    return method->isConst();
+                }
+                const unsigned index = memberOperator ? i - 1 : i;
+                return index >= callee->getNumParams() ||
+                       bindsReadOnly(callee->getParamDecl(index)->getType());
+            }
+            return false;
+        }
+        if (clang::isa<clang::DeclStmt>(parent)) {
+            // Only the range of a range-for, whose elements become const; a
+            // loop variable that modifies them would no longer compile.
+            auto loopParent = parents.find(parent);
+            const auto* loop = loopParent != parents.end()
+                                   ? clang::dyn_cast<clang::CXXForRangeStmt>(loopParent->second)
+                                   : nullptr;
+            if (!loop || loop->getRangeInit() != child) {
+                return false;
+            }
+            const clang::QualType element = loop->getLoopVariable()->getType();
+            return !element->isReferenceType() || element.getNonReferenceType().isConstQualified();
+        }
+        return false;
+    }
+}
+
+void ASTVisitor::findReadOnlyParams() {
+    if (readOnlyParams_ == SignatureChanges::Off || !currentFunction_->getBody() ||
+        !isSignatureChangeable(currentFunction_) ||
+        llvm::none_of(currentFunction_->parameters(), [this](const clang::ParmVarDecl* param) {
+            return isReadOnlyParamType(param);
+        })) {
+        return;
+    }
+
+    // Parents of everything the function runs, to see what each use is for.
+    // Member initializers have none, which keeps a parameter bound to a
+    // reference member as it is.
+    llvm::DenseMap<const clang::Stmt*, const clang::Stmt*> parents;
+    llvm::SmallVector<const clang::DeclRefExpr*, 16> refs;
+    mapParents(currentFunction_->getBody(), parents, refs);
+    if (const auto* ctor = clang::dyn_cast<clang::CXXConstructorDecl>(currentFunction_)) {
+        for (const clang::CXXCtorInitializer* init : ctor->inits()) {
+            if (init->getInit()) {
+                mapParents(init->getInit(), parents, refs);
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < currentFunction_->getNumParams(); ++i) {
+        const clang::ParmVarDecl* param = currentFunction_->getParamDecl(i);
+        if (!isReadOnlyParamType(param)) {
+            continue;
+        }
+        const bool readOnly = llvm::all_of(refs, [&](const clang::DeclRefExpr* ref) {
+            return ref->getDecl() != param || isReadOnlyUse(ref, parents);
+        });
+        const bool written = llvm::all_of(
+            currentFunction_->redecls(), [i](const clang::FunctionDecl* redecl) {
+                return redecl->getParamDecl(i)->getTypeSourceInfo() != nullptr;
+            });
+        if (!readOnly || !written) {
+            continue;
+        }
+
+        // The range runs from the start of the declaration so that a const
+        // already written before the type is part of it.
+        auto typeRange = [](const clang::ParmVarDecl* declared) {
+            return clang::SourceRange(
+                declared->getBeginLoc(),
+                declared->getTypeSourceInfo()->getTypeLoc().getSourceRange().getEnd());
+        };
+        if (readOnlyParams_ == SignatureChanges::Report) {
+            addTransformation(Transformation::READONLY_PARAM_BY_REF, param->getLocation(),
+                              typeRange(param), param->getType());
+            continue;
+        }
+        for (const clang::FunctionDecl* redecl : currentFunction_->redecls()) {
+            const clang::ParmVarDecl* declared = redecl->getParamDecl(i);
+            addTransformation(Transformation::READONLY_PARAM_BY_REF, declared->getLocation(),
+                              typeRange(declared), param->getType());
+        }
+    }
+}
+
+const clang::VarDecl* ASTVisitor::getCopiedLoopVariable(const clang::CXXForRangeStmt* loop) {
+    // "for (T x : range)" copy-constructs x from each element. An element of
+    // another type, say a derived class, would no longer be sliced if x
+    // referred to it.
+    const clang::VarDecl* var = loop->getLoopVariable();
+    if (!var || clang::isa<clang::DecompositionDecl>(var) || !var->getTypeSourceInfo() ||
+        var->getType()->isReferenceType() || !var->getType()->isRecordType() ||
+        var->getType().isVolatileQualified() || !var->getInit()) {
+        return nullptr;
+    }
+    const auto* construct = clang::dyn_cast<clang::CXXConstructExpr>(var->getInit()->IgnoreImplicit());
+    if (!construct || construct->getNumArgs() == 0 ||
+        !construct->getConstructor()->isCopyConstructor() ||
+        construct->getConstructor()->isTrivial()) {
+        return nullptr;
+    }
+    const clang::Expr* element = loopElement(construct);
+    return element->isLValue() && sameType(element->getType(), var->getType()) ? var : nullptr;
+}
+
+const clang::DeclRefExpr* ASTVisitor::getConsumableRange(const clang::CXXForRangeStmt* loop) {
+    // A local container whose elements the loop may modify in place
+    const clang::VarDecl* var = getCopiedLoopVariable(loop);
+    if (!var) {
+        return nullptr;
+    }
+    const auto* construct = clang::cast<clang::CXXConstructExpr>(var->getInit()->IgnoreImplicit());
+    if (loopElement(construct)->getType().isConstQualified()) {
+        return nullptr;
+    }
+    const auto* ref =
+        clang::dyn_cast_or_null<clang::DeclRefExpr>(loop->getRangeInit()->IgnoreParenImpCasts());
+    const auto* range = ref ? clang::dyn_cast<clang::VarDecl>(ref->getDecl()) : nullptr;
+    if (!range || range->getType()->isReferenceType() ||
+        range->getType().isConstQualified() || !isLivenessCandidate(range)) {
+        return nullptr;
+    }
+    return ref;
+}
+
+bool ASTVisitor::TraverseCXXForRangeStmt(clang::CXXForRangeStmt* loop) {
+    const size_t firstTransformation = transformations_.size();
+    if (!Base::TraverseCXXForRangeStmt(loop)) {
+        return false;
+    }
+    const clang::VarDecl* var = getCopiedLoopVariable(loop);
+    if (!var || !loop->getBody()) {
+        return true;
+    }
+
+    PhaseTimer timer(phaseTimes_ ? &phaseTimes_->lastUseQueries : nullptr);
+    llvm::DenseMap<const clang::Stmt*, const clang::Stmt*> parents;
+    llvm::SmallVector<const clang::DeclRefExpr*, 16> refs;
+    mapParents(loop->getBody(), parents, refs);
+
+    // A reference would see what the body writes to the range's variable,
+    // as in "names[0] = x", where the copy did not. Reads cannot change the
+    // element.
+    const clang::Expr* rangeBase = loop->getRangeInit()->IgnoreParenImpCasts();
+    while (const auto* member = clang::dyn_cast<clang::MemberExpr>(rangeBase)) {
+        rangeBase = member->getBase()->IgnoreParenImpCasts();
+    }
+    const auto* rangeRef = clang::dyn_cast<clang::DeclRefExpr>(rangeBase);
+    if (rangeRef && llvm::any_of(refs, [&](const clang::DeclRefExpr* ref) {
+            return ref->getDecl() == rangeRef->getDecl() && !isReadOnlyUse(ref, parents);
+        })) {
+        return true;
+    }
+    llvm::erase_if(refs, [var](const clang::DeclRefExpr* ref) { return ref->getDecl() != var; });
+
+    // A copy the body moves from is not read-only, whatever it is passed to.
+    // Nor is one an inner loop might consume, which is not worth telling
+    // apart from other inner loops.
+    const bool moved = std::any_of(
+        transformations_.begin() + firstTransformation, transformations_.end(),
+        [&refs](const Transformation& transformation) {
+            return transformation.type == Transformation::RANGE_FOR_CONSUME ||
+                   llvm::any_of(refs, [&transformation](const clang::DeclRefExpr* ref) {
+                       return transformation.range.getBegin() == ref->getBeginLoc();
+                   });
+        });
+    const clang::SourceRange typeRange(
+        var->getBeginLoc(), var->getTypeSourceInfo()->getTypeLoc().getSourceRange().getEnd());
+    if (!moved && llvm::all_of(refs, [&parents](const clang::DeclRefExpr* ref) {
+            return isReadOnlyUse(ref, parents);
+        })) {
+        addTransformation(Transformation::RANGE_FOR_CONST_REF, var->getLocation(), typeRange,
+                          var->getType());
+        return true;
+    }
+
+    // Once the range is dead the elements are the loop's to modify or move
+    // from. A returned copy would be copied out of a reference instead of
+    // implicitly moved.
+    const clang::DeclRefExpr* range = getConsumableRange(loop);
+    const bool returned = llvm::any_of(refs, [&parents](const clang::DeclRefExpr* ref) {
+        auto parent = parents.find(ref);
+        const auto* cast = parent != parents.end()
+                               ? clang::dyn_cast<clang::ImplicitCastExpr>(parent->second)
+                               : nullptr;
+        return cast && cast->getCastKind() == clang::CK_NoOp && cast->isXValue();
+    });
+    if (range && !returned && isLastUseInCurrentFunction(range)) {
+        addTransformation(Transformation::RANGE_FOR_CONSUME, var->getLocation(), typeRange,
+                          var->getType());
+    }
+    return true;
+}
+
+bool ASTVisitor::hasMoveCandidates(const clang::Stmt* body) {
+    llvm::SmallVector<const clang::Stmt*, 32> pending;
+    pending.push_back(body);
+    while (!pending.empty()) {
+        const clang::Stmt* stmt = pending.pop_back_val();
+        if (const auto* call = clang::dyn_cast<clang::CallExpr>(stmt)) {
+            for (unsigned i = 0; i < call->getNumArgs(); ++i) {
+                if (getMovableArgument(call, i)) {
+                    return true;
+                }
+            }
+        }
+        if (const auto* call = clang::dyn_cast<clang::CXXOperatorCallExpr>(stmt)) {
+            if (getMovableAssignmentSource(call)) {
+                return true;
+            }
+        }
+        if (const auto* declStmt = clang::dyn_cast<clang::DeclStmt>(stmt)) {
+            for (const clang::Decl* decl : declStmt->decls()) {
+                const auto* var = clang::dyn_cast<clang::VarDecl>(decl);
+                if (var && getMovableInitSource(var)) {
+                    return true;
+                }
+            }
+        }
+        if (const auto* loop = clang::dyn_cast<clang::CXXForRangeStmt>(stmt)) {
+            if (getConsumableRange(loop)) {
+                return true;
+            }
+        }
+        for (const clang::Stmt* child : stmt->children()) {
+            if (child) {
+                pending.push_back(child);
+            }
+        }
+    }
     return false;
 }
 
-const ASTVisitor::UsePosition* ASTVisitor::findUsePosition(const clang::VarDecl* var,
-                                                           clang::SourceLocation useLoc) const {
-    auto usesIt = variableUsePositions_.find(var);
-    if (usesIt == variableUsePositions_.end()) {
+bool ASTVisitor::referencesVariable(const clang::Stmt* stmt, const clang::ValueDecl* var) {
+    llvm::SmallVector<const clang::Stmt*, 16> pending;
+    pending.push_back(stmt);
+    while (!pending.empty()) {
+        const clang::Stmt* current = pending.pop_back_val();
+        if (const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(current)) {
+            if (ref->getDecl() == var) {
+                return true;
+            }
+        } else if (const auto* member = clang::dyn_cast<clang::MemberExpr>(current)) {
+            if (member->getMemberDecl() == var) {
+                return true;
+            }
+        }
+        for (const clang::Stmt* child : current->children()) {
+            if (child) {
+                pending.push_back(child);
+            }
+        }
+    }
+    return false;
+}
+
+bool ASTVisitor::isSafeToMove(clang::Expr* expr, const clang::Stmt* context) {
+    expr = ignoreImplicit(expr);
+    if (!expr || !context) {
+        return false;
+    }
+
+    if (!expr->isLValue()) {
+        return false;
+    }
+
+    auto* declRef = clang::dyn_cast<clang::DeclRefExpr>(expr);
+    if (!declRef || !isMovableVariable(declRef)) {
+        return false;
+    }
+
+    if (clang::isa<clang::ReturnStmt>(context)) {
+        return true;
+    }
+
+    if (clang::isa<clang::CallExpr>(context)) {
+        return isLastUseInCurrentFunction(declRef);
+    }
+
+    return false;
+}
+
+bool ASTVisitor::isLastUseInCurrentFunction(const clang::DeclRefExpr* ref) const {
+    if (!ref || !currentFunctionCfg_) {
+        return false;
+    }
+
+    auto it = useIndex_.find(ref);
+    return it != useIndex_.end() && !uses_[it->second].liveAfter;
+}
+
+bool ASTVisitor::isLivenessCandidate(const clang::VarDecl* var) {
+    if (!clang::isa<clang::ParmVarDecl>(var) && !var->hasLocalStorage()) {
+        return false;
+    }
+    return var->getType().getNonReferenceType()->isRecordType();
+}
+
+// `x = ...` through a copy or move assignment operator replaces the whole
+// value of x, so the reference to x on the left is not a read.
+const clang::DeclRefExpr* ASTVisitor::getOverwrittenVariable(const clang::Stmt* stmt) {
+    const auto* call = clang::dyn_cast<clang::CXXOperatorCallExpr>(stmt);
+    if (!call || call->getOperator() != clang::OO_Equal || call->getNumArgs() != 2) {
         return nullptr;
     }
+    const auto* method = clang::dyn_cast_or_null<clang::CXXMethodDecl>(call->getDirectCallee());
+    if (!method || (!method->isCopyAssignmentOperator() && !method->isMoveAssignmentOperator())) {
+        return nullptr;
+    }
+    const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(call->getArg(0)->IgnoreParenImpCasts());
+    const auto* var = ref ? clang::dyn_cast<clang::VarDecl>(ref->getDecl()) : nullptr;
+    if (!var || var->getType()->isReferenceType() || !isLivenessCandidate(var)) {
+        return nullptr;
+    }
+    return ref;
+}
+
+void ASTVisitor::collectUsesForCurrentFunction() {
+    useIndex_.clear();
+    variableIndex_.clear();
+    uses_.clear();
+    elementStmts_.clear();
+    overwrittenRefs_.clear();
+    cfgBlocksById_ = llvm::MutableArrayRef<const clang::CFGBlock*>();
+    blockUses_ = llvm::MutableArrayRef<std::pair<unsigned, unsigned>>();
+    functionArena_.Reset();
+    currentFunctionCfg_.reset();
+
+    if (!currentFunction_ || !currentFunction_->hasBody()) {
+        return;
+    }
+
+    // Building the CFG dominates the cost of analyzing a function, and most
+    // functions never ask for a last use. Skip it unless a variable could
+    // be moved.
+    if (!hasMoveCandidates(currentFunction_)) {
+        ++stats_.cfgBuildsSkipped;
+        return;
+    }
 
-    const auto& sm = context_.getSourceManager();
-    useLoc = sm.getExpansionLoc(useLoc);
-    for (const UsePosition& use : usesIt->second) {
-        if (sm.isWrittenInSameFile(use.location, useLoc) &&
-            sm.getFileOffset(use.location) == sm.getFileOffset(useLoc)) {
-            return &use;
+    {
+        llvm::TimeTraceScope scope("BuildCFG");
+        PhaseTimer timer(phaseTimes_ ? &phaseTimes_->cfgBuild : nullptr);
+        clang::CFG::BuildOptions options;
+        options.AddImplicitDtors = true;
+        options.AddTemporaryDtors = true;
+        options.AddInitializers = true;
+        currentFunctionCfg_ = clang::CFG::buildCFG(
+            currentFunction_, currentFunction_->getBody(), &context_, options);
+    }
+    if (!currentFunctionCfg_) {
+        return;
+    }
+    ++stats_.cfgsBuilt;
+    llvm::TimeTraceScope scope("CollectUses");
+    PhaseTimer useTimer(phaseTimes_ ? &phaseTimes_->useCollection : nullptr);
+
+    const unsigned numBlocks = currentFunctionCfg_->getNumBlockIDs();
+    cfgBlocksById_ = llvm::MutableArrayRef<const clang::CFGBlock*>(
+        functionArena_.Allocate<const clang::CFGBlock*>(numBlocks), numBlocks);
+    std::fill(cfgBlocksById_.begin(), cfgBlocksById_.end(), nullptr);
+    blockUses_ = llvm::MutableArrayRef<std::pair<unsigned, unsigned>>(
+        functionArena_.Allocate<std::pair<unsigned, unsigned>>(numBlocks), numBlocks);
+    std::fill(blockUses_.begin(), blockUses_.end(), std::make_pair(0u, 0u));
+
+    // The CFG already lists most subexpressions as elements of their own, so
+    // each element owns only the references that are not inside another
+    // element. Walking just that part visits every DeclRefExpr once.
+    for (const clang::CFGBlock* block : *currentFunctionCfg_) {
+        if (!block) {
+            continue;
+        }
+        for (const clang::CFGElement& element : *block) {
+            if (auto cfgStmt = element.getAs<clang::CFGStmt>()) {
+                elementStmts_.insert(cfgStmt->getStmt());
+                if (const auto* ref = getOverwrittenVariable(cfgStmt->getStmt())) {
+                    overwrittenRefs_.insert(ref);
+                }
+            }
         }
     }
-    return nullptr;
+
+    auto variableFor = [this](const clang::VarDecl* var) {
+        return variableIndex_.try_emplace(var, variableIndex_.size()).first->second;
+    };
+
+    auto& pending = pendingStmts_;
+    for (const clang::CFGBlock* block : *currentFunctionCfg_) {
+        if (!block) {
+            continue;
+        }
+        cfgBlocksById_[block->getBlockID()] = block;
+        blockUses_[block->getBlockID()].first = uses_.size();
+
+        unsigned elementIndex = 0;
+        for (const clang::CFGElement& element : *block) {
+            auto cfgStmt = element.getAs<clang::CFGStmt>();
+            if (!cfgStmt || !cfgStmt->getStmt()) {
+                ++elementIndex;
+                continue;
+            }
+
+            pending.push_back(cfgStmt->getStmt());
+            while (!pending.empty()) {
+                const clang::Stmt* stmt = pending.pop_back_val();
+                if (const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(stmt)) {
+                    const auto* var = clang::dyn_cast<clang::VarDecl>(ref->getDecl());
+                    if (var && isLivenessCandidate(var) && !overwrittenRefs_.count(ref)) {
+                        useIndex_[ref] = uses_.size();
+                        uses_.push_back({variableFor(var), block->getBlockID(), elementIndex,
+                                         false, false});
+                    }
+                }
+                for (const clang::Stmt* child : stmt->children()) {
+                    if (child && !elementStmts_.count(child)) {
+                        pending.push_back(child);
+                    }
+                }
+            }
+
+            // A declaration starts a fresh object each time it runs, as does
+            // assigning the whole variable, so earlier values are dead there.
+            // This is what lets a local declared in a loop body die at the
+            // end of each iteration.
+            const clang::Stmt* elementStmt = cfgStmt->getStmt();
+            if (const auto* declStmt = clang::dyn_cast<clang::DeclStmt>(elementStmt)) {
+                for (const clang::Decl* decl : declStmt->decls()) {
+                    const auto* var = clang::dyn_cast<clang::VarDecl>(decl);
+                    if (var && !var->getType()->isReferenceType() && isLivenessCandidate(var)) {
+                        uses_.push_back({variableFor(var), block->getBlockID(), elementIndex,
+                                         false, true});
+                    }
+                }
+            } else if (const auto* ref = getOverwrittenVariable(elementStmt)) {
+                uses_.push_back({variableFor(clang::cast<clang::VarDecl>(ref->getDecl())),
+                                 block->getBlockID(), elementIndex, false, true});
+            }
+
+            ++elementIndex;
+        }
+        blockUses_[block->getBlockID()].second = uses_.size();
+    }
+
+    computeLiveness();
+}
+
+void ASTVisitor::computeLiveness() {
+    const unsigned numBlocks = currentFunctionCfg_->getNumBlockIDs();
+    const unsigned numVars = variableIndex_.size();
+    if (numVars == 0) {
+        return;
+    }
+
+    const unsigned numWords = (numVars + BitsPerWord - 1) / BitsPerWord;
+    const size_t tableWords = static_cast<size_t>(numBlocks) * numWords;
+    BitWord* liveIn = functionArena_.Allocate<BitWord>(tableWords);
+    BitWord* liveOut = functionArena_.Allocate<BitWord>(tableWords);
+    BitWord* killed = functionArena_.Allocate<BitWord>(tableWords);
+    BitWord* live = functionArena_.Allocate<BitWord>(numWords);
+    std::fill_n(liveIn, tableWords, 0);
+    std::fill_n(liveOut, tableWords, 0);
+    std::fill_n(killed, tableWords, 0);
+
+    // Visits the elements of a block back to front. Within one element the
+    // references are read before a kill takes effect, and do not keep each
+    // other alive.
+    auto forEachElementBackwards = [this](unsigned id, auto&& visit) {
+        unsigned end = blockUses_[id].second;
+        while (end > blockUses_[id].first) {
+            unsigned begin = end - 1;
+            while (begin > blockUses_[id].first &&
+                   uses_[begin - 1].elementIndex == uses_[end - 1].elementIndex) {
+                --begin;
+            }
+            visit(begin, end);
+            end = begin;
+        }
+    };
+
+    // liveIn starts out as the variables a block reads before killing them.
+    for (unsigned id = 0; id < numBlocks; ++id) {
+        BitWord* gen = liveIn + id * numWords;
+        BitWord* kill = killed + id * numWords;
+        forEachElementBackwards(id, [&](unsigned begin, unsigned end) {
+            for (unsigned i = begin; i < end; ++i) {
+                if (uses_[i].kills) {
+                    setBit(kill, uses_[i].variable);
+                    resetBit(gen, uses_[i].variable);
+                }
+            }
+            for (unsigned i = begin; i < end; ++i) {
+                if (!uses_[i].kills) {
+                    setBit(gen, uses_[i].variable);
+                }
+            }
+        });
+    }
+
+    // liveIn(B) = gen(B) + (liveOut(B) - killed(B)) and liveOut(B) = union
+    // of liveIn over successors. Block IDs are handed out while the CFG is
+    // built back to front, so visiting low IDs first mostly sees successors
+    // before their predecessors and only loops need another round. A block
+    // is queued at most once, so the worklist never holds more than
+    // numBlocks entries.
+    unsigned* worklist = functionArena_.Allocate<unsigned>(numBlocks);
+    bool* queued = functionArena_.Allocate<bool>(numBlocks);
+    unsigned worklistSize = 0;
+    for (unsigned id = numBlocks; id-- > 0;) {
+        worklist[worklistSize++] = id;
+        queued[id] = true;
+    }
+
+    while (worklistSize > 0) {
+        const unsigned id = worklist[--worklistSize];
+        queued[id] = false;
+
+        const clang::CFGBlock* block = cfgBlocksById_[id];
+        if (!block) {
+            continue;
+        }
+
+        BitWord* out = liveOut + id * numWords;
+        bool outChanged = false;
+        for (const clang::CFGBlock::AdjacentBlock succ : block->succs()) {
+            if (const clang::CFGBlock* succBlock = succ.getReachableBlock()) {
+                outChanged |= unionInto(out, liveIn + succBlock->getBlockID() * numWords, numWords);
+            }
+        }
+        if (!outChanged) {
+            continue;
+        }
+        const BitWord* kill = killed + id * numWords;
+        for (unsigned i = 0; i < numWords; ++i) {
+            live[i] = out[i] & ~kill[i];
+        }
+        if (!unionInto(liveIn + id * numWords, live, numWords)) {
+            continue;
+        }
+
+        for (const clang::CFGBlock::AdjacentBlock pred : block->preds()) {
+            const clang::CFGBlock* predBlock = pred.getReachableBlock();
+            if (predBlock && !queued[predBlock->getBlockID()]) {
+                queued[predBlock->getBlockID()] = true;
+                worklist[worklistSize++] = predBlock->getBlockID();
+            }
+        }
+    }
+
+    // Walk each block backwards from its live-out set.
+    for (unsigned id = 0; id < numBlocks; ++id) {
+        std::copy_n(liveOut + id * numWords, numWords, live);
+        forEachElementBackwards(id, [&](unsigned begin, unsigned end) {
+            for (unsigned i = begin; i < end; ++i) {
+                uses_[i].liveAfter = testBit(live, uses_[i].variable);
+            }
+            for (unsigned i = begin; i < end; ++i) {
+                if (uses_[i].kills) {
+                    resetBit(live, uses_[i].variable);
+                }
+            }
+            for (unsigned i = begin; i < end; ++i) {
+                if (!uses_[i].kills) {
+                    setBit(live, uses_[i].variable);
+                }
+            }
+        });
+    }
+}
+
+std::optional<uint64_t> ASTVisitor::fingerprintFunction(const clang::FunctionDecl* function) {
+    // Instantiations share the source of their pattern, so their text does
+    // not tell them apart.
+    if (!function->getBody() || function->getTemplateInstantiationPattern()) {
+        return std::nullopt;
+    }
+
+    const clang::SourceManager& sm = context_.getSourceManager();
+    const clang::SourceRange range = function->getSourceRange();
+    if (!range.getBegin().isFileID() || !range.getEnd().isFileID() ||
+        sm.getFileID(range.getBegin()) != sm.getFileID(range.getEnd())) {
+        return std::nullopt;
+    }
+
+    // Stored decisions are relative to the start of the function, so the
+    // exact text is part of the key. The ODR hash adds what the text cannot
+    // show, such as which overload a call resolved to.
+    std::string key = clang::Lexer::getSourceText(
+        clang::CharSourceRange::getTokenRange(range), sm, context_.getLangOpts()).str();
+    if (key.empty()) {
+        return std::nullopt;
+    }
+    auto appendValue = [&key](uint64_t value) {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+
+    clang::ODRHash functionHash;
+    functionHash.AddFunctionDecl(function);
+    appendValue(functionHash.CalculateHash());
+
+    // Decisions also depend on declarations outside the body: whether a
+    // callee takes its parameter by value and whether a type can be moved.
+    llvm::SmallPtrSet<const clang::ValueDecl*, 16> referenced;
+    llvm::SmallVector<const clang::Stmt*, 32> pending;
+    pending.push_back(function->getBody());
+    if (const auto* ctor = clang::dyn_cast<clang::CXXConstructorDecl>(function)) {
+        for (const clang::CXXCtorInitializer* init : ctor->inits()) {
+            if (init->getInit()) {
+                pending.push_back(init->getInit());
+            }
+        }
+    }
+    while (!pending.empty()) {
+        const clang::Stmt* stmt = pending.pop_back_val();
+        const clang::ValueDecl* decl = nullptr;
+        if (const auto* ref = clang::dyn_cast<clang::DeclRefExpr>(stmt)) {
+            decl = ref->getDecl();
+        } else if (const auto* member = clang::dyn_cast<clang::MemberExpr>(stmt)) {
+            decl = member->getMemberDecl();
+        } else if (const auto* construct = clang::dyn_cast<clang::CXXConstructExpr>(stmt)) {
+            decl = construct->getConstructor();
+        }
+
+        if (decl && referenced.insert(decl).second) {
+            clang::ODRHash typeHash;
+            typeHash.AddQualType(decl->getType());
+            appendValue(typeHash.CalculateHash());
+
+            const clang::QualType type = decl->getType().getNonReferenceType();
+            const auto* record = type->getAsCXXRecordDecl();
+            if (record && record->hasDefinition() && !record->isLambda()) {
+                appendValue(record->getDefinition()->getODRHash());
+                appendValue(hasMoveConstructor(type));
+            }
+        }
+
+        for (const clang::Stmt* child : stmt->children()) {
+            if (child) {
+                pending.push_back(child);
+            }
+        }
+    }
+
+    return llvm::xxHash64(key);
+}
+
+bool ASTVisitor::replayDecisions(const clang::FunctionDecl* function, uint64_t fingerprint) {
+    std::optional<std::vector<StoredDecision>> decisions = decisionStore_->lookup(fingerprint);
+    if (!decisions) {
+        return false;
+    }
+
+    const clang::SourceLocation start = function->getSourceRange().getBegin();
+    for (const StoredDecision& decision : *decisions) {
+        transformations_.emplace_back(
+            decision.type,
+            start.getLocWithOffset(decision.location),
+            clang::SourceRange(start.getLocWithOffset(decision.rangeBegin),
+                               start.getLocWithOffset(decision.rangeEnd))
+        );
+        transformations_.back().function = function;
+        transformations_.back().copyCost = decision.copyCost;
+    }
+
+    ++stats_.functionsSeen;
+    ++stats_.functionsReused;
+    return true;
+}
+
+void ASTVisitor::recordDecisions(const clang::FunctionDecl* function, uint64_t fingerprint,
+                                 size_t firstTransformation) {
+    const clang::SourceManager& sm = context_.getSourceManager();
+    const clang::SourceLocation start = function->getSourceRange().getBegin();
+    const clang::FileID file = sm.getFileID(start);
+    const unsigned startOffset = sm.getFileOffset(start);
+
+    // Only decisions that lie in the function's own text can be replayed.
+    auto relativeOffset = [&](clang::SourceLocation loc, unsigned& offset) {
+        if (!loc.isFileID() || sm.getFileID(loc) != file || sm.getFileOffset(loc) < startOffset) {
+            return false;
+        }
+        offset = sm.getFileOffset(loc) - startOffset;
+        return true;
+    };
+
+    std::vector<StoredDecision> decisions;
+    for (size_t i = firstTransformation; i < transformations_.size(); ++i) {
+        const Transformation& transformation = transformations_[i];
+        StoredDecision decision{transformation.type, 0, 0, 0, transformation.copyCost};
+        if (!relativeOffset(transformation.location, decision.location) ||
+            !relativeOffset(transformation.range.getBegin(), decision.rangeBegin) ||
+            !relativeOffset(transformation.range.getEnd(), decision.rangeEnd)) {
+            return;
+        }
+        decisions.push_back(decision);
+    }
+
+    decisionStore_->record(fingerprint, std::move(decisions));
+}
+
+void ASTVisitor::addTransformation(Transformation::Type type, clang::SourceLocation loc,
+                                   clang::SourceRange range, clang::QualType valueType) {
+    transformations_.emplace_back(type, loc, range);
+    transformations_.back().function = currentFunction_;
+    if (type == Transformation::EMPLACE_INSERT || type == Transformation::TRY_EMPLACE_INSERT) {
+        // An emplace saves moving the temporary, which copies its bytes.
+        transformations_.back().copyCost =
+            valueType->isIncompleteType() || valueType->isDependentType()
+                ? 0
+                : context_.getTypeSizeInChars(valueType).getQuantity();
+    } else {
+        transformations_.back().copyCost = estimateCopyCost(valueType);
+    }
+}
+
+uint64_t ASTVisitor::estimateCopyCost(clang::QualType type) {
+    type = type.getNonReferenceType().getCanonicalType().getUnqualifiedType();
+    auto cached = copyCosts_.find(type.getTypePtr());
+    if (cached != copyCosts_.end()) {
+        return cached->second;
+    }
+
+    // A trivially copyable type is copied by its move constructor as well.
+    uint64_t cost = 0;
+    if (!type->isDependentType() && !type->isIncompleteType() &&
+        !type.isTriviallyCopyableType(context_)) {
+        cost = context_.getTypeSizeInChars(type).getQuantity() + estimateHeapCost(type, 0);
+    }
+    copyCosts_[type.getTypePtr()] = cost;
+    return cost;
+}
+
+uint64_t ASTVisitor::estimateHeapCost(clang::QualType type, unsigned depth) {
+    type = type.getNonReferenceType().getCanonicalType();
+    if (depth > MaxCostDepth) {
+        return 0;
+    }
+    if (const auto* array = context_.getAsConstantArrayType(type)) {
+        return array->getSize().getZExtValue() *
+               estimateHeapCost(array->getElementType(), depth + 1);
+    }
+
+    const auto* record = type->getAsCXXRecordDecl();
+    if (!record || !record->hasDefinition()) {
+        return 0;
+    }
+
+    switch (standardOwnership(record)) {
+        case Ownership::Buffer:
+            return AllocationCost;
+        case Ownership::Shared:
+            return SharedCopyCost;
+        case Ownership::Container: {
+            // Copying a container copies each element, and with it whatever
+            // the elements own.
+            uint64_t elementCost = 0;
+            if (const auto* specialization =
+                    clang::dyn_cast<clang::ClassTemplateSpecializationDecl>(record)) {
+                const clang::TemplateArgumentList& args = specialization->getTemplateArgs();
+                const unsigned valueArgs = record->getName().contains("map") ? 2 : 1;
+                for (unsigned i = 0; i < valueArgs && i < args.size(); ++i) {
+                    if (args[i].getKind() == clang::TemplateArgument::Type) {
+                        elementCost += estimateHeapCost(args[i].getAsType(), depth + 1);
+                    }
+                }
+            }
+            return AllocationCost + ElementsPerContainer * elementCost;
+        }
+        case Ownership::None:
+            break;
+    }
+
+    uint64_t cost = 0;
+    for (const clang::CXXBaseSpecifier& base : record->bases()) {
+        cost += estimateHeapCost(base.getType(), depth + 1);
+    }
+    for (const clang::FieldDecl* field : record->fields()) {
+        cost += estimateHeapCost(field->getType(), depth + 1);
+    }
+    if (cost == 0) {
+        // A hand-written copy constructor most likely does real work.
+        for (const clang::CXXConstructorDecl* ctor : record->ctors()) {
+            if (ctor->isCopyConstructor() && ctor->isUserProvided()) {
+                return AllocationCost;
+            }
+        }
+    }
+    return cost;
 }
 
 clang::Expr* ASTVisitor::ignoreImplicit(clang::Expr* expr) {
@@ -4,7 +4,10 @@
 #include <clang/Basic/SourceManager.h>
 #include <clang/AST/Expr.h>
 #include <clang/Lex/Lexer.h>
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/Path.h>
 #include <sstream>
 #include <algorithm>
 #include <cctype>
@@ -12,8 +15,8 @@
 namespace move_optimizer {
 
 CodeTransformer::CodeTransformer(clang::ASTContext& context, 
-                                  clang::Rewriter& rewriter)
-    : context_(context), rewriter_(rewriter), insertedMoveInFile_(false), utilityHeaderEnsured_(false) {
+                                  clang::Rewriter* rewriter)
+    : context_(context), rewriter_(rewriter), replacementsComplete_(true), movesApplied_(0) {
 }
 
 bool CodeTransformer::applyTransformation(const Transformation& transformation) {
@@ -21,6 +24,21 @@ bool CodeTransformer::applyTransformation(const Transformation& transformation)
     if (!validateTransformation(transformation)) {
         return false;
     }
+
+    // Moves inside the temporary stay valid, so an emplace only claims the
+    // text it edits.
+    if (transformation.type == Transformation::EMPLACE_INSERT ||
+        transformation.type == Transformation::TRY_EMPLACE_INSERT) {
+        return rewriteAsEmplace(transformation);
+    }
+    if (transformation.type == Transformation::SINK_PARAM_BY_VALUE) {
+        return rewriteAsByValue(transformation);
+    }
+    if (transformation.type == Transformation::READONLY_PARAM_BY_REF ||
+        transformation.type == Transformation::RANGE_FOR_CONST_REF ||
+        transformation.type == Transformation::RANGE_FOR_CONSUME) {
+        return rewriteAsByReference(transformation);
+    }
     
     // Check if already moved
     if (isAlreadyMoved(transformation.range)) {
@@ -33,6 +51,7 @@ bool CodeTransformer::applyTransformation(const Transformation& transformation)
         case Transformation::FUNCTION_ARG_MOVE:
         case Transformation::VARIABLE_ASSIGNMENT_MOVE:
         case Transformation::CONSTRUCTOR_INIT_MOVE:
+        case Transformation::SINK_PARAM_MOVE:
             success = wrapWithMove(transformation.range);
             break;
         default:
@@ -49,24 +68,54 @@ bool CodeTransformer::applyTransformation(const Transformation& transformation)
 bool CodeTransformer::applyTransformations(
     const std::vector<Transformation>& transformations) {
     bool success = true;
-    insertedMoveInFile_ = false;
+    filesWithMoves_.clear();
+
+    // A signature change that cannot reach every declaration, say one in a
+    // header outside --header-root, is left out as a whole.
+    llvm::SmallPtrSet<const clang::FunctionDecl*, 4> incomplete;
+    llvm::SmallVector<clang::CharSourceRange, 3> removals;
+    llvm::SmallVector<std::pair<clang::SourceLocation, llvm::StringRef>, 2> insertions;
+    for (const Transformation& transformation : transformations) {
+        if (!isSignatureChange(transformation.type)) {
+            continue;
+        }
+        removals.clear();
+        insertions.clear();
+        if (!transformation.range.isValid() ||
+            !isEditableFile(transformation.range.getBegin()) ||
+            (transformation.type == Transformation::SINK_PARAM_BY_VALUE &&
+             !planByValue(transformation.range, removals)) ||
+            (transformation.type == Transformation::READONLY_PARAM_BY_REF &&
+             !planByReference(transformation.range, true, insertions))) {
+            incomplete.insert(transformation.function);
+        }
+    }
     
     // Apply transformations in reverse order to preserve source locations
     for (auto it = transformations.rbegin(); it != transformations.rend(); ++it) {
+        if (isSignatureChange(it->type) && incomplete.contains(it->function)) {
+            continue;
+        }
         if (!applyTransformation(*it)) {
             success = false;
         }
     }
 
-    if (insertedMoveInFile_ && !ensureUtilityHeader()) {
-        success = false;
+    for (clang::FileID file : filesWithMoves_) {
+        if (!ensureUtilityHeader(file)) {
+            success = false;
+        }
     }
     
     return success;
 }
 
 std::string CodeTransformer::getTransformedCode() const {
-    const clang::RewriteBuffer* buffer = rewriter_.getRewriteBufferFor(
+    if (!rewriter_) {
+        return "";
+    }
+
+    const clang::RewriteBuffer* buffer = rewriter_->getRewriteBufferFor(
         context_.getSourceManager().getMainFileID());
     
     if (!buffer) {
@@ -80,11 +129,14 @@ bool CodeTransformer::insertMove(clang::SourceLocation loc,
                                   clang::SourceRange range) {
     // Insert std::move at the specified location
     std::string moveCode = "std::move(";
-    rewriter_.InsertTextBefore(loc, moveCode);
+    if (!rewriter_) {
+        return false;
+    }
+    rewriter_->InsertTextBefore(loc, moveCode);
     
     // Find the end of the range and insert closing parenthesis
     clang::SourceLocation end = range.getEnd();
-    rewriter_.InsertTextAfterToken(end, ")");
+    rewriter_->InsertTextAfterToken(end, ")");
     
     return true;
 }
@@ -109,13 +161,237 @@ bool CodeTransformer::wrapWithMove(clang::SourceRange range) {
     
     // Wrap with std::move
     std::string moveCode = "std::move(";
-    rewriter_.InsertTextBefore(begin, moveCode);
-    rewriter_.InsertTextAfterToken(end, ")");
-    insertedMoveInFile_ = true;
+    if (rewriter_) {
+        rewriter_->InsertTextBefore(begin, moveCode);
+        rewriter_->InsertTextAfterToken(end, ")");
+    }
+    recordInsertion(begin, moveCode);
+    recordInsertion(end.getLocWithOffset(clang::Lexer::MeasureTokenLength(end, sm, langOpts)), ")");
+    const clang::FileID file = sm.getFileID(begin);
+    if (!llvm::is_contained(filesWithMoves_, file)) {
+        filesWithMoves_.push_back(file);
+    }
+    ++movesApplied_;
     
     return true;
 }
 
+bool CodeTransformer::rewriteAsEmplace(const Transformation& transformation) {
+    clang::SourceManager& sm = context_.getSourceManager();
+    const auto& langOpts = context_.getLangOpts();
+
+    // push_back(Widget(a, b)) becomes emplace_back(a, b): the member name is
+    // replaced and the temporary up to its '(' and the final ')' removed.
+    const clang::SourceLocation name = transformation.location;
+    const clang::SourceLocation begin = transformation.range.getBegin();
+    const clang::SourceLocation end = transformation.range.getEnd();
+    const clang::SourceLocation open = findMatchingParen(transformation.range);
+    if (!name.isFileID() || open.isInvalid() || sm.getFileID(name) != sm.getFileID(begin)) {
+        return false;
+    }
+
+    const unsigned nameLength = clang::Lexer::MeasureTokenLength(name, sm, langOpts);
+    const llvm::StringRef method(sm.getCharacterData(name), nameLength);
+    const llvm::StringRef emplace = transformation.type == Transformation::TRY_EMPLACE_INSERT
+                                        ? llvm::StringRef("try_emplace")
+                                        : emplaceCounterpart(method);
+    if (emplace.empty()) {
+        return false;
+    }
+
+    const clang::SourceRange edited[] = {{name, name}, {begin, open}, {end, end}};
+    for (const clang::SourceRange& range : edited) {
+        if (checkOverlap(range)) {
+            return false;
+        }
+    }
+
+    const unsigned prefixLength = sm.getFileOffset(open) + 1 - sm.getFileOffset(begin);
+    if (rewriter_) {
+        rewriter_->ReplaceText(name, nameLength, emplace);
+        rewriter_->RemoveText(begin, prefixLength);
+        rewriter_->RemoveText(end, 1);
+    }
+    recordReplacement(name, nameLength, emplace);
+    recordReplacement(begin, prefixLength, "");
+    recordReplacement(end, 1, "");
+    appliedRanges_.append(std::begin(edited), std::end(edited));
+    ++movesApplied_;
+
+    return true;
+}
+
+bool CodeTransformer::planByValue(clang::SourceRange range,
+                                  llvm::SmallVectorImpl<clang::CharSourceRange>& removals) const {
+    const clang::SourceManager& sm = context_.getSourceManager();
+    if (!range.getBegin().isFileID() || !range.getEnd().isFileID() ||
+        sm.getFileID(range.getBegin()) != sm.getFileID(range.getEnd())) {
+        return false;
+    }
+
+    // "const T&" or "T const&": drop the const with the space that separates
+    // it from T, and the '&'.
+    const clang::FileID file = sm.getFileID(range.getBegin());
+    const llvm::StringRef buffer = sm.getBufferData(file);
+    const unsigned endOffset = sm.getFileOffset(range.getEnd());
+    clang::Lexer lexer(sm.getLocForStartOfFile(file), context_.getLangOpts(), buffer.begin(),
+                       buffer.begin() + sm.getFileOffset(range.getBegin()), buffer.end());
+    llvm::SmallVector<clang::Token, 8> tokens;
+    clang::Token token;
+    while (true) {
+        lexer.LexFromRawLexer(token);
+        if (token.is(clang::tok::eof) || sm.getFileOffset(token.getLocation()) > endOffset) {
+            break;
+        }
+        tokens.push_back(token);
+    }
+    if (tokens.size() < 3 || tokens.back().isNot(clang::tok::amp) ||
+        sm.getFileOffset(tokens.back().getLocation()) != endOffset) {
+        return false;
+    }
+
+    auto isConst = [](const clang::Token& token) {
+        return token.is(clang::tok::raw_identifier) && token.getRawIdentifier() == "const";
+    };
+    const clang::Token& beforeAmp = tokens[tokens.size() - 2];
+    if (isConst(tokens.front())) {
+        removals.push_back(clang::CharSourceRange::getCharRange(tokens.front().getLocation(),
+                                                                tokens[1].getLocation()));
+    } else if (isConst(beforeAmp)) {
+        const clang::Token& type = tokens[tokens.size() - 3];
+        removals.push_back(clang::CharSourceRange::getCharRange(type.getEndLoc(),
+                                                                beforeAmp.getEndLoc()));
+    } else {
+        return false;
+    }
+    removals.push_back(clang::CharSourceRange::getCharRange(tokens.back().getLocation(),
+                                                            tokens.back().getEndLoc()));
+    return true;
+}
+
+bool CodeTransformer::rewriteAsByValue(const Transformation& transformation) {
+    llvm::SmallVector<clang::CharSourceRange, 3> removals;
+    if (!planByValue(transformation.range, removals)) {
+        return false;
+    }
+
+    const clang::SourceManager& sm = context_.getSourceManager();
+    for (const clang::CharSourceRange& removal : removals) {
+        const unsigned length =
+            sm.getFileOffset(removal.getEnd()) - sm.getFileOffset(removal.getBegin());
+        if (rewriter_) {
+            rewriter_->RemoveText(removal.getBegin(), length);
+        }
+        recordReplacement(removal.getBegin(), length, "");
+    }
+    appliedRanges_.push_back(transformation.range);
+    return true;
+}
+
+bool CodeTransformer::planByReference(
+    clang::SourceRange range, bool addConst,
+    llvm::SmallVectorImpl<std::pair<clang::SourceLocation, llvm::StringRef>>& insertions) const {
+    const clang::SourceManager& sm = context_.getSourceManager();
+    if (!range.getBegin().isFileID() || !range.getEnd().isFileID() ||
+        sm.getFileID(range.getBegin()) != sm.getFileID(range.getEnd())) {
+        return false;
+    }
+
+    // "T" becomes "const T&", or "T&" without addConst; a type already
+    // written "const T" or "T const" only gains the '&'. The end may lie
+    // inside a ">>".
+    const clang::FileID file = sm.getFileID(range.getBegin());
+    const llvm::StringRef buffer = sm.getBufferData(file);
+    const unsigned endOffset = sm.getFileOffset(range.getEnd());
+    clang::Lexer lexer(sm.getLocForStartOfFile(file), context_.getLangOpts(), buffer.begin(),
+                       buffer.begin() + sm.getFileOffset(range.getBegin()), buffer.end());
+    llvm::SmallVector<clang::Token, 8> tokens;
+    clang::Token token;
+    while (true) {
+        lexer.LexFromRawLexer(token);
+        if (token.is(clang::tok::eof) || sm.getFileOffset(token.getLocation()) > endOffset) {
+            break;
+        }
+        tokens.push_back(token);
+    }
+    const clang::SourceLocation end =
+        clang::Lexer::getLocForEndOfToken(range.getEnd(), 0, sm, context_.getLangOpts());
+    // Attributes have to stay in front of the const.
+    if (tokens.empty() || tokens.front().is(clang::tok::l_square) || end.isInvalid()) {
+        return false;
+    }
+
+    auto isConst = [](const clang::Token& token) {
+        return token.is(clang::tok::raw_identifier) && token.getRawIdentifier() == "const";
+    };
+    if (addConst && !isConst(tokens.front()) && !isConst(tokens.back())) {
+        insertions.emplace_back(range.getBegin(), "const ");
+    }
+    insertions.emplace_back(end, "&");
+    return true;
+}
+
+bool CodeTransformer::rewriteAsByReference(const Transformation& transformation) {
+    llvm::SmallVector<std::pair<clang::SourceLocation, llvm::StringRef>, 2> insertions;
+    if (!planByReference(transformation.range,
+                         transformation.type != Transformation::RANGE_FOR_CONSUME, insertions)) {
+        return false;
+    }
+
+    for (const auto& insertion : insertions) {
+        if (rewriter_) {
+            rewriter_->InsertTextBefore(insertion.first, insertion.second);
+        }
+        recordInsertion(insertion.first, insertion.second);
+    }
+    appliedRanges_.push_back(transformation.range);
+    return true;
+}
+
+clang::SourceLocation CodeTransformer::findMatchingParen(clang::SourceRange range) const {
+    const clang::SourceManager& sm = context_.getSourceManager();
+    if (!range.getBegin().isFileID() || !range.getEnd().isFileID()) {
+        return clang::SourceLocation();
+    }
+    const clang::FileID file = sm.getFileID(range.getBegin());
+    if (sm.getFileID(range.getEnd()) != file) {
+        return clang::SourceLocation();
+    }
+
+    // Raw lexing skips comments and literals that may contain parentheses.
+    const llvm::StringRef buffer = sm.getBufferData(file);
+    const unsigned endOffset = sm.getFileOffset(range.getEnd());
+    clang::Lexer lexer(sm.getLocForStartOfFile(file), context_.getLangOpts(), buffer.begin(),
+                       buffer.begin() + sm.getFileOffset(range.getBegin()), buffer.end());
+    llvm::SmallVector<clang::SourceLocation, 8> open;
+    clang::Token token;
+    while (true) {
+        lexer.LexFromRawLexer(token);
+        if (token.is(clang::tok::eof)) {
+            break;
+        }
+        const unsigned offset = sm.getFileOffset(token.getLocation());
+        if (offset > endOffset) {
+            break;
+        }
+        if (token.is(clang::tok::l_paren)) {
+            open.push_back(token.getLocation());
+        } else if (token.is(clang::tok::r_paren)) {
+            if (open.empty()) {
+                break;
+            }
+            const clang::SourceLocation match = open.pop_back_val();
+            if (offset == endOffset) {
+                return match;
+            }
+        }
+        if (offset == endOffset) {
+            break;
+        }
+    }
+    return clang::SourceLocation();
+}
+
 std::string CodeTransformer::generateMoveCode(const Transformation& transformation) {
     std::ostringstream oss;
     
@@ -124,6 +400,7 @@ std::string CodeTransformer::generateMoveCode(const Transformation& transformati
         case Transformation::FUNCTION_ARG_MOVE:
         case Transformation::VARIABLE_ASSIGNMENT_MOVE:
         case Transformation::CONSTRUCTOR_INIT_MOVE:
+        case Transformation::SINK_PARAM_MOVE:
             oss << "std::move(" << transformation.originalCode << ")";
             break;
         default:
@@ -138,22 +415,43 @@ bool CodeTransformer::validateTransformation(const Transformation& transformatio
         return false;
     }
     
-    clang::SourceManager& sm = context_.getSourceManager();
-    
-    // Check if range is in the main file
-    clang::FileID fileID = sm.getFileID(transformation.range.getBegin());
-    if (fileID != sm.getMainFileID()) {
-        return false; // Only transform main file
+    // Check if range is in the main file or a header we may edit
+    if (!isEditableFile(transformation.range.getBegin())) {
+        return false;
     }
     
-    // Check for overlap with already applied transformations
-    if (checkOverlap(transformation.range)) {
+    // Check for overlap with already applied transformations. An emplace
+    // checks the pieces it edits instead.
+    if (transformation.type != Transformation::EMPLACE_INSERT &&
+        transformation.type != Transformation::TRY_EMPLACE_INSERT &&
+        checkOverlap(transformation.range)) {
         return false;
     }
     
     return true;
 }
 
+bool CodeTransformer::isEditableFile(clang::SourceLocation loc) const {
+    const clang::SourceManager& sm = context_.getSourceManager();
+    const clang::FileID fileID = sm.getFileID(loc);
+    if (fileID == sm.getMainFileID()) {
+        return true;
+    }
+    if (headerRoot_.empty() || !loc.isFileID() || sm.isInSystemHeader(loc)) {
+        return false;
+    }
+
+    clang::OptionalFileEntryRef entry = sm.getFileEntryRefForID(fileID);
+    if (!entry) {
+        return false;
+    }
+    llvm::StringRef path = entry->getFileEntry().tryGetRealPathName();
+    if (!path.consume_front(headerRoot_)) {
+        return false;
+    }
+    return path.empty() || llvm::sys::path::is_separator(path.front());
+}
+
 bool CodeTransformer::isAlreadyMoved(clang::SourceRange range) {
     clang::SourceManager& sm = context_.getSourceManager();
     const auto& langOpts = context_.getLangOpts();
@@ -215,20 +513,19 @@ bool CodeTransformer::isValidMoveTarget(clang::Expr* expr) {
     return true;
 }
 
-bool CodeTransformer::ensureUtilityHeader() {
-    if (utilityHeaderEnsured_) {
+bool CodeTransformer::ensureUtilityHeader(clang::FileID file) {
+    if (utilityHeaderEnsured_.contains(file)) {
         return true;
     }
 
     clang::SourceManager& sm = context_.getSourceManager();
-    clang::FileID mainFileId = sm.getMainFileID();
-    llvm::StringRef buffer = sm.getBufferData(mainFileId);
+    llvm::StringRef buffer = sm.getBufferData(file);
     if (buffer.empty()) {
         return false;
     }
 
     if (buffer.contains("#include <utility>") || buffer.contains("#include \"utility\"")) {
-        utilityHeaderEnsured_ = true;
+        utilityHeaderEnsured_.insert(file);
         return true;
     }
 
@@ -270,11 +567,44 @@ bool CodeTransformer::ensureUtilityHeader() {
         offset = lineEnd;
     }
 
-    clang::SourceLocation insertLoc = sm.getLocForStartOfFile(mainFileId).getLocWithOffset(insertOffset);
+    clang::SourceLocation insertLoc = sm.getLocForStartOfFile(file).getLocWithOffset(insertOffset);
     const char* includeText = hasIncludes ? "#include <utility>\n" : "#include <utility>\n\n";
-    rewriter_.InsertTextBefore(insertLoc, includeText);
-    utilityHeaderEnsured_ = true;
+    if (rewriter_) {
+        rewriter_->InsertTextBefore(insertLoc, includeText);
+    }
+    recordInsertion(insertLoc, includeText);
+    utilityHeaderEnsured_.insert(file);
     return true;
 }
 
+void CodeTransformer::recordInsertion(clang::SourceLocation loc, llvm::StringRef text) {
+    recordReplacement(loc, 0, text);
+}
+
+void CodeTransformer::recordReplacement(clang::SourceLocation loc, unsigned length,
+                                        llvm::StringRef text) {
+    // The Rewriter ignores locations inside macros, and so do we.
+    if (!loc.isValid() || !loc.isFileID()) {
+        return;
+    }
+
+    // Header edits are merged across units, which may spell the same header
+    // differently, so they are keyed by the real path.
+    const clang::SourceManager& sm = context_.getSourceManager();
+    const clang::FileID fileID = sm.getFileID(loc);
+    clang::tooling::Replacement replacement(sm, loc, length, text);
+    if (fileID != sm.getMainFileID()) {
+        clang::OptionalFileEntryRef entry = sm.getFileEntryRefForID(fileID);
+        if (entry && !entry->getFileEntry().tryGetRealPathName().empty()) {
+            replacement = clang::tooling::Replacement(
+                entry->getFileEntry().tryGetRealPathName(), replacement.getOffset(), length,
+                text);
+        }
+    }
+    if (llvm::Error err = replacements_[replacement.getFilePath().str()].add(replacement)) {
+        llvm::consumeError(std::move(err));
+        replacementsComplete_ = false;
+    }
+}
+
 } // namespace move_optimizer
@@ -0,0 +1,167 @@
+#include "decision_store.h"
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+#include <algorithm>
+#include <chrono>
+#include <tuple>
+
+namespace move_optimizer {
+
+namespace {
+
+// Store layout, one function per line:
+//   move-optimizer-functions 2 <tool identity hash>
+//   fn <fingerprint> <last used> <count> (<type> <location> <begin> <end> <copy cost>)*
+constexpr llvm::StringLiteral StoreHeader = "move-optimizer-functions 2";
+
+int64_t now() {
+    return llvm::sys::toTimeT(std::chrono::system_clock::now());
+}
+
+} // namespace
+
+DecisionStore::DecisionStore(std::string path, uint64_t sizeLimitBytes, std::string toolIdentity)
+    : path_(std::move(path)),
+      sizeLimitBytes_(sizeLimitBytes),
+      toolIdentity_(llvm::utohexstr(llvm::xxHash64(toolIdentity))),
+      changed_(false) {
+    load();
+}
+
+void DecisionStore::load() {
+    auto buffer = llvm::MemoryBuffer::getFile(path_);
+    if (!buffer) {
+        return;
+    }
+
+    llvm::StringRef cursor = (*buffer)->getBuffer();
+    llvm::StringRef line;
+    std::tie(line, cursor) = cursor.split('\n');
+    if (!line.consume_front(StoreHeader) || line.trim() != toolIdentity_) {
+        return;
+    }
+
+    llvm::SmallVector<llvm::StringRef, 32> fields;
+    while (!cursor.empty()) {
+        std::tie(line, cursor) = cursor.split('\n');
+        fields.clear();
+        line.split(fields, ' ', -1, /*KeepEmpty=*/false);
+
+        uint64_t fingerprint = 0;
+        Entry entry;
+        unsigned count = 0;
+        if (fields.size() < 4 || fields[0] != "fn" || fields[1].getAsInteger(16, fingerprint) ||
+            fields[2].getAsInteger(10, entry.lastUsed) || fields[3].getAsInteger(10, count) ||
+            fields.size() != 4 + size_t(count) * 5) {
+            continue;
+        }
+
+        bool valid = true;
+        for (unsigned i = 0; i < count && valid; ++i) {
+            const size_t base = 4 + size_t(i) * 5;
+            unsigned type = 0;
+            StoredDecision decision{};
+            valid = !fields[base].getAsInteger(10, type) &&
+                    type <= Transformation::RANGE_FOR_CONSUME &&
+                    !fields[base + 1].getAsInteger(10, decision.location) &&
+                    !fields[base + 2].getAsInteger(10, decision.rangeBegin) &&
+                    !fields[base + 3].getAsInteger(10, decision.rangeEnd) &&
+                    !fields[base + 4].getAsInteger(10, decision.copyCost);
+            decision.type = static_cast<Transformation::Type>(type);
+            entry.decisions.push_back(decision);
+        }
+        if (valid) {
+            entries_[fingerprint] = std::move(entry);
+        }
+    }
+}
+
+std::optional<std::vector<StoredDecision>> DecisionStore::lookup(uint64_t fingerprint) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(fingerprint);
+    if (it == entries_.end()) {
+        return std::nullopt;
+    }
+    it->second.lastUsed = now();
+    changed_ = true;
+    return it->second.decisions;
+}
+
+void DecisionStore::record(uint64_t fingerprint, std::vector<StoredDecision> decisions) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[fingerprint] = Entry{std::move(decisions), now()};
+    changed_ = true;
+}
+
+void DecisionStore::save() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!changed_) {
+        return;
+    }
+
+    std::vector<std::pair<uint64_t, const Entry*>> ordered;
+    ordered.reserve(entries_.size());
+    for (const auto& entry : entries_) {
+        ordered.emplace_back(entry.first, &entry.second);
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.second->lastUsed > rhs.second->lastUsed;
+    });
+
+    std::string contents;
+    llvm::raw_string_ostream os(contents);
+    os << StoreHeader << " " << toolIdentity_ << "\n";
+    for (const auto& entry : ordered) {
+        const uint64_t before = os.tell();
+        os << "fn " << llvm::utohexstr(entry.first) << " " << entry.second->lastUsed << " "
+           << entry.second->decisions.size();
+        for (const StoredDecision& decision : entry.second->decisions) {
+            os << " " << unsigned(decision.type) << " " << decision.location << " "
+               << decision.rangeBegin << " " << decision.rangeEnd << " " << decision.copyCost;
+        }
+        os << "\n";
+        if (os.tell() > sizeLimitBytes_) {
+            os.flush();
+            contents.resize(before);
+            break;
+        }
+    }
+    os.flush();
+
+    llvm::SmallString<256> parentDir(path_);
+    llvm::sys::path::remove_filename(parentDir);
+    if (!parentDir.empty() && llvm::sys::fs::create_directories(parentDir)) {
+        return;
+    }
+
+    // Replace the store atomically so that a concurrent run reads either
+    // version in full.
+    llvm::SmallString<256> tempPath;
+    int fd = -1;
+    if (llvm::sys::fs::createUniqueFile(path_ + ".%%%%%%.tmp", fd, tempPath)) {
+        return;
+    }
+    {
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        out << contents;
+        out.close();
+        if (out.has_error()) {
+            out.clear_error();
+            llvm::sys::fs::remove(tempPath);
+            return;
+        }
+    }
+    if (llvm::sys::fs::rename(tempPath, path_)) {
+        llvm::sys::fs::remove(tempPath);
+    }
+}
+
+} // namespace move_optimizer
@@ -0,0 +1,169 @@
+#include "function_profile.h"
+#include <clang/AST/DeclCXX.h>
+#include <clang/AST/GlobalDecl.h>
+#include <clang/Basic/ABI.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/xxhash.h>
+#include <algorithm>
+#include <cctype>
+
+namespace move_optimizer {
+
+namespace {
+
+bool isIndented(llvm::StringRef line) {
+    return !line.empty() && std::isspace(static_cast<unsigned char>(line.front()));
+}
+
+// The symbol a clone was made from: ThinLTO promotion, unique internal
+// linkage names and hot/cold splitting append these.
+llvm::StringRef stripCloneSuffix(llvm::StringRef name) {
+    for (llvm::StringRef marker : {".llvm.", ".__uniq.", ".cold"}) {
+        const size_t pos = name.find(marker);
+        if (pos != llvm::StringRef::npos && pos != 0) {
+            name = name.take_front(pos);
+        }
+    }
+    return name;
+}
+
+} // namespace
+
+std::optional<FunctionProfile> FunctionProfile::load(llvm::StringRef path,
+                                                     llvm::raw_ostream& err) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        err << "Error reading profile " << path << ": " << buffer.getError().message() << "\n";
+        return std::nullopt;
+    }
+
+    FunctionProfile profile;
+    const llvm::StringRef text = (*buffer)->getBuffer();
+    profile.hash_ = llvm::xxHash64(text);
+    // Only instrumentation profiles carry per-function hash records.
+    const bool parsed = text.contains("# Func Hash:") ? profile.parseInstrumentationText(text)
+                                                      : profile.parseSampleOrPlainText(text);
+    if (!parsed) {
+        err << "Error: " << path << " is not a function profile\n";
+        return std::nullopt;
+    }
+    return profile;
+}
+
+bool FunctionProfile::parseInstrumentationText(llvm::StringRef text) {
+    // Records are a name, a structural hash, the number of counters and the
+    // counters themselves, one per line. Comments and ":ir"-style flags sit
+    // between them.
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    text.split(lines, '\n');
+    llvm::SmallVector<llvm::StringRef, 0> values;
+    for (llvm::StringRef line : lines) {
+        line = line.trim();
+        if (!line.empty() && !line.startswith("#") && !line.startswith(":")) {
+            values.push_back(line);
+        }
+    }
+
+    size_t i = 0;
+    while (i + 2 < values.size()) {
+        llvm::StringRef name = values[i];
+        uint64_t hash = 0;
+        uint64_t numCounters = 0;
+        if (values[i + 1].getAsInteger(0, hash) || values[i + 2].getAsInteger(10, numCounters) ||
+            i + 3 + numCounters > values.size()) {
+            return false;
+        }
+        uint64_t hottest = 0;
+        for (uint64_t c = 0; c < numCounters; ++c) {
+            uint64_t count = 0;
+            if (values[i + 3 + c].getAsInteger(10, count)) {
+                return false;
+            }
+            hottest = std::max(hottest, count);
+        }
+        // Functions with internal linkage are prefixed with their file.
+        add(name.contains(';') ? name.rsplit(';').second : name, hottest);
+        i += 3 + numCounters;
+    }
+    return !counts_.empty();
+}
+
+bool FunctionProfile::parseSampleOrPlainText(llvm::StringRef text) {
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    text.split(lines, '\n');
+    for (llvm::StringRef line : lines) {
+        // Indented lines of a sample profile describe the function body.
+        if (isIndented(line)) {
+            continue;
+        }
+        line = line.split('#').first.trim();
+        if (line.empty()) {
+            continue;
+        }
+
+        // "<name>:<total samples>:<head samples>"
+        llvm::StringRef rest, head, total, name;
+        std::tie(rest, head) = line.rsplit(':');
+        std::tie(name, total) = rest.rsplit(':');
+        uint64_t count = 0;
+        uint64_t headCount = 0;
+        if (!name.empty() && !total.getAsInteger(10, count) && !head.getAsInteger(10, headCount)) {
+            add(name, count);
+            continue;
+        }
+
+        // "<function> <count>"
+        const size_t split = line.find_last_of(" \t");
+        if (split == llvm::StringRef::npos ||
+            line.drop_front(split + 1).getAsInteger(10, count)) {
+            return false;
+        }
+        add(line.take_front(split).trim(), count);
+    }
+    return !counts_.empty();
+}
+
+void FunctionProfile::add(llvm::StringRef name, uint64_t count) {
+    // A name listed twice, say for two clones, counts with both.
+    counts_[stripCloneSuffix(name)] += count;
+}
+
+uint64_t FunctionProfile::countFor(const clang::FunctionDecl* function,
+                                   clang::MangleContext& mangler) const {
+    if (mangler.shouldMangleDeclName(function)) {
+        // Constructors and destructors have a complete-object and a
+        // base-object symbol, and either may be the one that was profiled,
+        // say when one is an alias of the other.
+        llvm::SmallVector<clang::GlobalDecl, 2> decls;
+        if (const auto* ctor = llvm::dyn_cast<clang::CXXConstructorDecl>(function)) {
+            decls.push_back(clang::GlobalDecl(ctor, clang::Ctor_Complete));
+            decls.push_back(clang::GlobalDecl(ctor, clang::Ctor_Base));
+        } else if (const auto* dtor = llvm::dyn_cast<clang::CXXDestructorDecl>(function)) {
+            decls.push_back(clang::GlobalDecl(dtor, clang::Dtor_Complete));
+            decls.push_back(clang::GlobalDecl(dtor, clang::Dtor_Base));
+        } else {
+            decls.push_back(clang::GlobalDecl(function));
+        }
+
+        std::optional<uint64_t> hottest;
+        for (const clang::GlobalDecl& decl : decls) {
+            std::string mangled;
+            llvm::raw_string_ostream os(mangled);
+            mangler.mangleName(decl, os);
+            os.flush();
+            auto it = counts_.find(mangled);
+            if (it != counts_.end()) {
+                hottest = std::max(hottest.value_or(0), it->second);
+            }
+        }
+        if (hottest) {
+            return *hottest;
+        }
+    }
+
+    auto it = counts_.find(function->getQualifiedNameAsString());
+    return it != counts_.end() ? it->second : 0;
+}
+
+} // namespace move_optimizer
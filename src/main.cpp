@@ -1,18 +1,37 @@
+#include "decision_store.h"
+#include "function_profile.h"
 #include "move_optimizer.h"
+#include "optimizer_action.h"
+#include "preamble_server.h"
+#include "replacement_export.h"
+#include "result_cache.h"
 #include <clang/Tooling/Tooling.h>
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <clang/Frontend/FrontendActions.h>
-#include <clang/AST/ASTConsumer.h>
-#include <clang/AST/ASTContext.h>
 #include <clang/Frontend/CompilerInstance.h>
-#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Tooling/Core/Replacement.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/Chrono.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <llvm/Support/VirtualFileSystem.h>
 #include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
-#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <optional>
 #include <system_error>
+#include <thread>
+#include <vector>
 
 using namespace clang;
 using namespace clang::tooling;
@@ -26,104 +45,361 @@ static llvm::cl::opt<std::string> OutputDir("out-dir",
     llvm::cl::desc("Output directory for multi-file mode"),
     llvm::cl::value_desc("directory"),
     llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<bool> InPlace("in-place",
+    llvm::cl::desc("Overwrite input files that have changes instead of writing .optimized copies"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<unsigned> Jobs("j",
+    llvm::cl::desc("Number of translation units to process in parallel (0 = one per core)"),
+    llvm::cl::value_desc("N"),
+    llvm::cl::init(1),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<bool> PrintStats("stats",
+    llvm::cl::desc("Print analysis statistics after all files are processed"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<std::string> CacheDir("cache-dir",
+    llvm::cl::desc("Directory for cached results of unchanged translation units"),
+    llvm::cl::value_desc("directory"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<unsigned> CacheSizeLimit("cache-size-limit",
+    llvm::cl::desc("Maximum size of the result cache in MiB"),
+    llvm::cl::value_desc("MiB"),
+    llvm::cl::init(512),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<move_optimizer::BodySkipping> SkipFunctionBodies("skip-function-bodies",
+    llvm::cl::desc("Function bodies to leave unparsed"),
+    llvm::cl::values(
+        clEnumValN(move_optimizer::BodySkipping::None, "none", "Parse every body"),
+        clEnumValN(move_optimizer::BodySkipping::SystemHeaders, "system",
+                   "Skip bodies in system headers"),
+        clEnumValN(move_optimizer::BodySkipping::Headers, "headers",
+                   "Skip bodies outside the main file")),
+    llvm::cl::init(move_optimizer::BodySkipping::None),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<std::string> ServeSocket("serve",
+    llvm::cl::desc("Run as a server that keeps preambles warm, listening on a Unix socket"),
+    llvm::cl::value_desc("socket"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<std::string> ConnectSocket("connect",
+    llvm::cl::desc("Send the input files to a server started with --serve"),
+    llvm::cl::value_desc("socket"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<bool> ShutdownServer("shutdown-server",
+    llvm::cl::desc("With --connect, stop the server after the input files are processed"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<std::string> ExportReplacements("export-replacements",
+    llvm::cl::desc("Export edits instead of writing optimized files (a directory for yaml, "
+                   "a file or - for jsonl)"),
+    llvm::cl::value_desc("path"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<move_optimizer::ExportFormat> ExportFormat("export-format",
+    llvm::cl::desc("Format of --export-replacements"),
+    llvm::cl::values(
+        clEnumValN(move_optimizer::ExportFormat::Yaml, "yaml",
+                   "clang-apply-replacements files, one per translation unit"),
+        clEnumValN(move_optimizer::ExportFormat::Jsonl, "jsonl", "One JSON object per edit")),
+    llvm::cl::init(move_optimizer::ExportFormat::Yaml),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<std::string> TimeTrace("time-trace",
+    llvm::cl::desc("Write a Chrome trace of the run with per-file and per-function spans"),
+    llvm::cl::value_desc("filename"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<unsigned> TimeTraceGranularity("time-trace-granularity",
+    llvm::cl::desc("Shortest span kept by --time-trace, in microseconds"),
+    llvm::cl::value_desc("us"),
+    llvm::cl::init(500),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<unsigned> MinCopyCost("min-copy-cost",
+    llvm::cl::desc("Only insert moves whose avoided copy has at least this estimated cost"),
+    llvm::cl::value_desc("cost"),
+    llvm::cl::init(0),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<std::string> Profile("profile",
+    llvm::cl::desc("Execution counts per function: \"<function> <count>\" lines or an "
+                   "llvm-profdata text export"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<unsigned long long> MinFunctionCount("min-function-count",
+    llvm::cl::desc("Only insert moves in functions that ran at least this often (needs --profile)"),
+    llvm::cl::value_desc("count"),
+    llvm::cl::init(0),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<bool> ReportCandidates("report-candidates",
+    llvm::cl::desc("List every move candidate ranked by estimated copy cost, weighted by "
+                   "execution count with --profile"),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<move_optimizer::SignatureChanges> SinkParams("sink-params",
+    llvm::cl::desc("const& parameters only copied into members, which could be taken by value "
+                   "and moved"),
+    llvm::cl::values(
+        clEnumValN(move_optimizer::SignatureChanges::Off, "off", "Leave them alone"),
+        clEnumValN(move_optimizer::SignatureChanges::Report, "report",
+                   "List them with the move candidates"),
+        clEnumValN(move_optimizer::SignatureChanges::Rewrite, "rewrite",
+                   "Take them by value in every declaration and move them")),
+    llvm::cl::init(move_optimizer::SignatureChanges::Off),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<move_optimizer::SignatureChanges> ReadOnlyParams("readonly-params",
+    llvm::cl::desc("By-value parameters that are only read, which could be taken by const&"),
+    llvm::cl::values(
+        clEnumValN(move_optimizer::SignatureChanges::Off, "off", "Leave them alone"),
+        clEnumValN(move_optimizer::SignatureChanges::Report, "report",
+                   "List them with the move candidates"),
+        clEnumValN(move_optimizer::SignatureChanges::Rewrite, "rewrite",
+                   "Take them by const& in every declaration")),
+    llvm::cl::init(move_optimizer::SignatureChanges::Off),
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::list<std::string> EmplaceContainers("emplace-containers",
+    llvm::cl::desc("Also turn inserts of temporaries into these containers (qualified class "
+                   "names) into emplaces; standard containers always are"),
+    llvm::cl::value_desc("class"),
+    llvm::cl::CommaSeparated,
+    llvm::cl::cat(MoveOptimizerCategory));
+static llvm::cl::opt<std::string> HeaderRoot("header-root",
+    llvm::cl::desc("Also rewrite non-system headers below this directory"),
+    llvm::cl::value_desc("directory"),
+    llvm::cl::cat(MoveOptimizerCategory));
 
-class MoveOptimizerAction : public ASTFrontendAction {
-public:
-    MoveOptimizerAction() : rewriter_(nullptr) {}
-    
-    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance& CI, 
-                                                    StringRef file) override {
-        rewriter_ = std::make_unique<Rewriter>(CI.getSourceManager(), CI.getLangOpts());
-        return std::make_unique<MoveOptimizerConsumer>(&CI.getASTContext(), rewriter_.get());
-    }
-    
-    void EndSourceFileAction() override {
-        if (!rewriter_) {
-            return;
+// Proposed signature changes are listed with the candidates.
+static bool reportingCandidates() {
+    return ReportCandidates || SinkParams == move_optimizer::SignatureChanges::Report ||
+           ReadOnlyParams == move_optimizer::SignatureChanges::Report;
+}
+
+// Output of one translation unit processed by a worker. Messages are buffered
+// so that they can be printed in input order once the unit is done.
+struct TranslationUnitResult {
+    std::string out;
+    std::string err;
+    std::string exported;       // JSON lines with --export-format=jsonl
+    std::vector<move_optimizer::CandidateReport> candidates;
+    move_optimizer::AnalysisStats stats;
+    int status = 0;
+    bool done = false;
+};
+
+// Shared, read-mostly state of one run over the source paths
+struct RunContext {
+    const CompilationDatabase& compilations;
+    const move_optimizer::OutputOptions& output;
+    const move_optimizer::ResultCache* cache;
+    move_optimizer::DecisionStore* decisionStore;
+    bool exporting;             // Edits are exported, no file is rewritten
+    const std::string& headerRoot;
+    move_optimizer::HeaderEditCollector* headerEdits;   // Null unless headers are rewritten
+    const move_optimizer::FunctionProfile* profile;     // Null without --profile
+};
+
+// The analysis settings of run, the same for every way of running it.
+// Callers say where the results go.
+static move_optimizer::ActionConfig makeActionConfig(const RunContext& run) {
+    move_optimizer::ActionConfig config;
+    config.decisionStore = run.decisionStore;
+    config.skipBodies = SkipFunctionBodies;
+    config.headerRoot = run.headerRoot;
+    config.minCopyCost = MinCopyCost;
+    config.profile = run.profile;
+    config.minFunctionCount = MinFunctionCount;
+    config.emplaceContainers.assign(EmplaceContainers.begin(), EmplaceContainers.end());
+    config.sinkParams = SinkParams;
+    config.readOnlyParams = ReadOnlyParams;
+    return config;
+}
+
+// edits with every path resolved against the directory of command
+static move_optimizer::FileEdits absoluteEdits(const CompileCommand& command,
+                                               const move_optimizer::FileEdits& edits) {
+    move_optimizer::FileEdits result;
+    for (const auto& fileEdits : edits) {
+        const std::string path = move_optimizer::absolutePathFor(command, fileEdits.first);
+        for (const clang::tooling::Replacement& edit : fileEdits.second) {
+            llvm::cantFail(result[path].add(clang::tooling::Replacement(
+                path, edit.getOffset(), edit.getLength(), edit.getReplacementText())));
         }
-        
-        // Get the output file name
-        std::string outputPath;
-        if (!OutputFile.empty()) {
-            outputPath = OutputFile;
-        } else if (!OutputDir.empty()) {
-            llvm::SmallString<256> outputPathBuf(OutputDir);
-            llvm::sys::path::append(outputPathBuf, llvm::sys::path::filename(getCurrentFile()));
-            outputPathBuf += ".optimized";
-            outputPath = outputPathBuf.str().str();
-
-            llvm::SmallString<256> parentDir(outputPathBuf);
-            llvm::sys::path::remove_filename(parentDir);
-            if (!parentDir.empty()) {
-                std::error_code dirEc = llvm::sys::fs::create_directories(parentDir);
-                if (dirEc) {
-                    llvm::errs() << "Error creating output directory: " << dirEc.message() << "\n";
-                    return;
+    }
+    return result;
+}
+
+// Hand the edits of a unit to --export-replacements
+static void exportEdits(const RunContext& run, const std::string& mainFile,
+                        const move_optimizer::FileEdits& edits,
+                        TranslationUnitResult& result, llvm::raw_ostream& err) {
+    if (ExportFormat == move_optimizer::ExportFormat::Jsonl) {
+        result.exported = move_optimizer::formatReplacementsJsonl(mainFile, edits);
+    } else if (!move_optimizer::exportReplacementsYaml(ExportReplacements, mainFile, edits,
+                                                       err)) {
+        result.status = 1;
+    }
+}
+
+static void runOnFile(const RunContext& run, const std::string& file,
+                      TranslationUnitResult& result) {
+    llvm::raw_string_ostream out(result.out);
+    llvm::raw_string_ostream err(result.err);
+    llvm::TimeTraceScope scope("TranslationUnit", file);
+
+    // Units with a single compile command can be served from the cache; the
+    // key would be ambiguous for the rest.
+    std::vector<CompileCommand> commands;
+    if (run.cache || run.exporting || run.headerEdits) {
+        commands = run.compilations.getCompileCommands(getAbsolutePath(file));
+    }
+    // A cached unit is not analyzed, so it would be missing from the report.
+    if (run.cache && commands.size() == 1 && !reportingCandidates()) {
+        if (std::optional<move_optimizer::FileEdits> edits = run.cache->lookup(commands[0])) {
+            const std::string mainFile =
+                move_optimizer::absolutePathFor(commands[0], commands[0].Filename);
+            if (run.exporting) {
+                exportEdits(run, mainFile, *edits, result, err);
+                out.flush();
+                err.flush();
+                return;
+            }
+            if (move_optimizer::writeEditedFile(run.output, mainFile, *edits, out, err,
+                                                &result.stats.bytesWritten)) {
+                if (run.headerEdits) {
+                    run.headerEdits->add(mainFile, *edits);
                 }
+                out.flush();
+                err.flush();
+                return;
             }
-        } else {
-            outputPath = getCurrentFile().str() + ".optimized";
         }
-        
-        // Write the transformed code
-        std::error_code EC;
-        llvm::raw_fd_ostream OS(outputPath, EC, llvm::sys::fs::OF_None);
-        if (EC) {
-            llvm::errs() << "Error opening output file: " << EC.message() << "\n";
-            return;
+    }
+    // An in-place run rewrites the files it would have to stamp afterwards.
+    move_optimizer::UnitRecord record;
+    const bool cacheResult = run.cache && commands.size() == 1 && !run.output.inPlace;
+
+    // Each worker gets its own tool and a physical file system that does not
+    // share the process working directory, so tools never race on chdir.
+    ClangTool tool(run.compilations, {file}, std::make_shared<PCHContainerOperations>(),
+                   llvm::vfs::createPhysicalFileSystem());
+    llvm::IntrusiveRefCntPtr<DiagnosticOptions> diagOpts = new DiagnosticOptions();
+    TextDiagnosticPrinter diagPrinter(err, diagOpts.get());
+    tool.setDiagnosticConsumer(&diagPrinter);
+
+    move_optimizer::ActionConfig config = makeActionConfig(run);
+    config.output = run.exporting ? nullptr : &run.output;
+    config.record = cacheResult || run.exporting || run.headerEdits ? &record : nullptr;
+    config.collectDependencies = cacheResult;
+    config.candidates = reportingCandidates() ? &result.candidates : nullptr;
+    move_optimizer::MoveOptimizerActionFactory factory(out, err, result.stats, config);
+    result.status = tool.run(&factory);
+    if (cacheResult && result.status == 0 && record.complete) {
+        run.cache->store(commands[0], record.dependencies, record.edits);
+    }
+    // A unit with several compile commands keeps the edits of its last run
+    // only, so its edits can neither be exported nor merged into headers.
+    const bool singleRun = commands.size() == 1 && record.complete;
+    if (run.exporting && result.status == 0) {
+        if (!singleRun) {
+            err << "Error: cannot export edits for " << file << "\n";
+            result.status = 1;
+        } else {
+            exportEdits(run, move_optimizer::absolutePathFor(commands[0], commands[0].Filename),
+                        absoluteEdits(commands[0], record.edits), result, err);
         }
-        
-        const RewriteBuffer* buffer = rewriter_->getRewriteBufferFor(
-            getCompilerInstance().getSourceManager().getMainFileID());
-        
-        if (buffer) {
-            OS << std::string(buffer->begin(), buffer->end());
+    }
+    if (run.headerEdits && result.status == 0) {
+        if (!singleRun) {
+            err << "Warning: header edits from " << file << " were dropped\n";
         } else {
-            // No changes made, write original file
-            const SourceManager& SM = getCompilerInstance().getSourceManager();
-            clang::FileID mainFileID = SM.getMainFileID();
-            const FileEntry* FE = SM.getFileEntryForID(mainFileID);
-            if (FE) {
-                std::string filename = FE->getName().str();
-                std::ifstream input(filename);
-                if (input.is_open()) {
-                    OS << input.rdbuf();
-                }
-            }
+            run.headerEdits->add(
+                move_optimizer::absolutePathFor(commands[0], commands[0].Filename),
+                absoluteEdits(commands[0], record.edits));
         }
-        
-        llvm::outs() << "Optimized: " << getCurrentFile() << " -> " << outputPath << "\n";
     }
+    out.flush();
+    err.flush();
+}
 
-private:
-    std::unique_ptr<Rewriter> rewriter_;
-    
-    class MoveOptimizerConsumer : public ASTConsumer {
-    public:
-        MoveOptimizerConsumer(ASTContext* context, Rewriter* rewriter) 
-            : context_(context), rewriter_(rewriter) {}
-        
-        void HandleTranslationUnit(ASTContext& context) override {
-            move_optimizer::MoveOptimizer optimizer(context, *rewriter_);
-            if (!optimizer.processAST(context)) {
-                llvm::errs() << "Error processing AST\n";
-                return;
-            }
-            
-            if (!optimizer.applyTransformations()) {
-                llvm::errs() << "Error applying transformations\n";
-                return;
-            }
+static void printStats(const move_optimizer::AnalysisStats& stats) {
+    llvm::errs() << "=== move-optimizer statistics ===\n"
+                 << "functions seen:       " << stats.functionsSeen << "\n"
+                 << "CFGs built:           " << stats.cfgsBuilt << "\n"
+                 << "CFG builds skipped:   " << stats.cfgBuildsSkipped << "\n"
+                 << "functions reused:     " << stats.functionsReused << "\n"
+                 << "candidates:           " << stats.candidates << "\n"
+                 << "moves applied:        " << stats.movesApplied << "\n"
+                 << "bytes written:        " << stats.bytesWritten << "\n";
+}
+
+static int runParallel(const RunContext& run, const std::vector<std::string>& sourcePaths,
+                       unsigned jobs, llvm::raw_ostream& exported,
+                       std::vector<move_optimizer::CandidateReport>& candidates,
+                       move_optimizer::AnalysisStats& stats) {
+    std::vector<TranslationUnitResult> results(sourcePaths.size());
+    std::atomic<size_t> nextIndex(0);
+    std::mutex mutex;
+    std::condition_variable resultReady;
+
+    // The trace profiler is per thread; finished threads hand their spans
+    // to the main thread's profiler, which writes them all.
+    const bool tracing = llvm::timeTraceProfilerEnabled();
+    auto worker = [&]() {
+        if (tracing) {
+            llvm::timeTraceProfilerInitialize(TimeTraceGranularity, "move-optimizer");
+        }
+        for (size_t i = nextIndex++; i < sourcePaths.size(); i = nextIndex++) {
+            TranslationUnitResult result;
+            runOnFile(run, sourcePaths[i], result);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            results[i] = std::move(result);
+            results[i].done = true;
+            resultReady.notify_all();
+        }
+        if (tracing) {
+            llvm::timeTraceProfilerFinishThread();
         }
-        
-    private:
-        ASTContext* context_;
-        Rewriter* rewriter_;
     };
-};
+
+    std::vector<std::thread> workers;
+    workers.reserve(jobs);
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    // Report units in input order while later ones are still running.
+    int status = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        TranslationUnitResult result;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            resultReady.wait(lock, [&]() { return results[i].done; });
+            result = std::move(results[i]);
+        }
+        llvm::outs() << result.out;
+        llvm::errs() << result.err;
+        exported << result.exported;
+        std::move(result.candidates.begin(), result.candidates.end(),
+                  std::back_inserter(candidates));
+        stats += result.stats;
+        status = move_optimizer::combineStatus(status, result.status);
+    }
+
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+    return status;
+}
+
+// Identifies this build of the tool so that a rebuilt optimizer never reuses
+// results of an older one. Empty if the executable cannot be found.
+static std::string toolIdentity(const char* argv0) {
+    std::string executable =
+        llvm::sys::fs::getMainExecutable(argv0, reinterpret_cast<void*>(&toolIdentity));
+    llvm::sys::fs::file_status status;
+    if (executable.empty() || llvm::sys::fs::status(executable, status)) {
+        return "";
+    }
+    return executable + ":" + std::to_string(status.getSize()) + ":" +
+           std::to_string(llvm::sys::toTimeT(status.getLastModificationTime()));
+}
 
 int main(int argc, const char** argv) {
-    auto ExpectedParser = CommonOptionsParser::create(argc, argv, MoveOptimizerCategory);
+    // A server takes its files from clients, so sources are optional here.
+    auto ExpectedParser = CommonOptionsParser::create(argc, argv, MoveOptimizerCategory,
+                                                      llvm::cl::ZeroOrMore);
     if (!ExpectedParser) {
         llvm::errs() << ExpectedParser.takeError();
         return 1;
@@ -131,18 +407,199 @@ int main(int argc, const char** argv) {
     
     CommonOptionsParser& OptionsParser = ExpectedParser.get();
     const auto& sourcePaths = OptionsParser.getSourcePathList();
+    if (ServeSocket.empty() && sourcePaths.empty()) {
+        llvm::errs() << "Error: no input files.\n";
+        return 1;
+    }
+    if (!ServeSocket.empty() && !ConnectSocket.empty()) {
+        llvm::errs() << "Error: --serve and --connect cannot be used together.\n";
+        return 1;
+    }
+    if (!TimeTrace.empty() && (!ServeSocket.empty() || !ConnectSocket.empty())) {
+        llvm::errs() << "Error: --time-trace cannot be combined with --serve or --connect.\n";
+        return 1;
+    }
     if (!OutputFile.empty() && !OutputDir.empty()) {
         llvm::errs() << "Error: -o and --out-dir cannot be used together.\n";
         return 1;
     }
+    if (InPlace && (!OutputFile.empty() || !OutputDir.empty())) {
+        llvm::errs() << "Error: --in-place cannot be combined with -o or --out-dir.\n";
+        return 1;
+    }
+    if (!ExportReplacements.empty() &&
+        (!OutputFile.empty() || !OutputDir.empty() || InPlace || !ServeSocket.empty() ||
+         !ConnectSocket.empty())) {
+        llvm::errs() << "Error: --export-replacements cannot be combined with -o, --out-dir, "
+                        "--in-place, --serve or --connect.\n";
+        return 1;
+    }
+    std::string headerRoot;
+    if (!HeaderRoot.empty()) {
+        if (!ServeSocket.empty() || !ConnectSocket.empty()) {
+            llvm::errs() << "Error: --header-root cannot be combined with --serve or --connect.\n";
+            return 1;
+        }
+        if (SkipFunctionBodies == move_optimizer::BodySkipping::Headers) {
+            llvm::errs() << "Error: --header-root needs the header bodies that "
+                            "--skip-function-bodies=headers skips.\n";
+            return 1;
+        }
+        // Headers are matched by real path, so the root must be one too.
+        llvm::SmallString<256> realRoot;
+        if (std::error_code ec = llvm::sys::fs::real_path(HeaderRoot, realRoot)) {
+            llvm::errs() << "Error: cannot resolve --header-root " << HeaderRoot << ": "
+                         << ec.message() << "\n";
+            return 1;
+        }
+        headerRoot = std::string(realRoot.str());
+    }
+    if (MinFunctionCount != 0 && Profile.empty()) {
+        llvm::errs() << "Error: --min-function-count needs --profile.\n";
+        return 1;
+    }
+    if (!Profile.empty() && !ConnectSocket.empty()) {
+        llvm::errs() << "Error: --profile belongs to the --serve side of a server.\n";
+        return 1;
+    }
+    std::optional<move_optimizer::FunctionProfile> profile;
+    if (!Profile.empty()) {
+        profile = move_optimizer::FunctionProfile::load(Profile, llvm::errs());
+        if (!profile) {
+            return 1;
+        }
+    }
     if (!OutputFile.empty() && sourcePaths.size() != 1) {
         llvm::errs() << "Error: -o is only supported with a single input file. "
                         "Use --out-dir for multiple files.\n";
         return 1;
     }
 
-    ClangTool Tool(OptionsParser.getCompilations(), 
-                   sourcePaths);
-    
-    return Tool.run(newFrontendActionFactory<MoveOptimizerAction>().get());
+    // Workers resolve relative paths against their compile command's
+    // directory, so the output paths are fixed to the working directory here.
+    const move_optimizer::OutputOptions output{
+        OutputFile.empty() ? std::string() : getAbsolutePath(OutputFile),
+        OutputDir.empty() ? std::string() : getAbsolutePath(OutputDir), InPlace};
+    if (!ConnectSocket.empty()) {
+        return move_optimizer::runClient(ConnectSocket, sourcePaths, output, ShutdownServer);
+    }
+
+    unsigned jobs = Jobs;
+    if (jobs == 0) {
+        jobs = llvm::heavyweight_hardware_concurrency().compute_thread_count();
+    }
+    jobs = std::min<size_t>(std::max(jobs, 1u), std::max<size_t>(sourcePaths.size(), 1));
+    std::optional<move_optimizer::ResultCache> cache;
+    std::optional<move_optimizer::DecisionStore> decisionStore;
+    if (!CacheDir.empty()) {
+        std::string identity = toolIdentity(argv[0]);
+        if (identity.empty()) {
+            llvm::errs() << "Warning: cannot locate the executable; result cache disabled.\n";
+        } else {
+            const uint64_t sizeLimit = uint64_t(CacheSizeLimit) * 1024 * 1024;
+            // Emplace containers and signature changes shape the per-function
+            // decisions as well.
+            for (const std::string& container : EmplaceContainers) {
+                identity += ":emplace=" + container;
+            }
+            if (SinkParams != move_optimizer::SignatureChanges::Off) {
+                identity += ":sink-params=" + std::to_string(int(SinkParams.getValue()));
+            }
+            if (ReadOnlyParams != move_optimizer::SignatureChanges::Off) {
+                identity += ":readonly-params=" + std::to_string(int(ReadOnlyParams.getValue()));
+            }
+            // Header edits and the cost threshold shape the cached result.
+            std::string resultIdentity = identity;
+            if (!headerRoot.empty()) {
+                resultIdentity += ":" + headerRoot;
+            }
+            if (MinCopyCost != 0) {
+                resultIdentity += ":min-copy-cost=" + std::to_string(MinCopyCost);
+            }
+            // Without a threshold the profile only affects the report.
+            if (MinFunctionCount != 0) {
+                resultIdentity += ":profile=" + llvm::utohexstr(profile->getHash()) +
+                                  ":min-function-count=" + std::to_string(MinFunctionCount);
+            }
+            cache.emplace(CacheDir, sizeLimit, resultIdentity);
+            llvm::SmallString<256> storePath(CacheDir);
+            llvm::sys::path::append(storePath, "functions.store");
+            decisionStore.emplace(std::string(storePath.str()), sizeLimit, identity);
+        }
+    }
+
+    // Exported edits already cover the headers they touch.
+    std::optional<move_optimizer::HeaderEditCollector> headerEdits;
+    if (!headerRoot.empty() && ExportReplacements.empty()) {
+        headerEdits.emplace();
+    }
+
+    if (!TimeTrace.empty()) {
+        llvm::timeTraceProfilerInitialize(TimeTraceGranularity, "move-optimizer");
+    }
+
+    move_optimizer::AnalysisStats stats;
+    std::vector<move_optimizer::CandidateReport> candidates;
+    int status = 0;
+    const RunContext run{OptionsParser.getCompilations(), output, cache ? &*cache : nullptr,
+                         decisionStore ? &*decisionStore : nullptr,
+                         !ExportReplacements.empty(), headerRoot,
+                         headerEdits ? &*headerEdits : nullptr, profile ? &*profile : nullptr};
+    if (!ServeSocket.empty()) {
+        move_optimizer::PreambleServer server(run.compilations, makeActionConfig(run));
+        status = server.serve(ServeSocket);
+        stats = server.getStats();
+    } else if (run.exporting) {
+        // JSON lines go to one stream; yaml files are written by the workers.
+        std::error_code ec;
+        std::unique_ptr<llvm::raw_fd_ostream> exportFile;
+        if (ExportFormat == move_optimizer::ExportFormat::Jsonl && ExportReplacements != "-") {
+            exportFile = std::make_unique<llvm::raw_fd_ostream>(ExportReplacements, ec);
+            if (ec) {
+                llvm::errs() << "Error opening " << ExportReplacements << ": " << ec.message()
+                             << "\n";
+                return 1;
+            }
+        }
+        status = runParallel(run, sourcePaths, jobs, exportFile ? *exportFile : llvm::outs(),
+                             candidates, stats);
+    } else if (jobs > 1 || cache || headerEdits || !TimeTrace.empty()) {
+        // Per-file spans come from runOnFile, so traced runs take this path.
+        status = runParallel(run, sourcePaths, jobs, llvm::nulls(), candidates, stats);
+        if (headerEdits) {
+            status = move_optimizer::combineStatus(
+                status, headerEdits->write(output, llvm::outs(), llvm::errs(),
+                                           &stats.bytesWritten));
+        }
+    } else {
+        ClangTool Tool(OptionsParser.getCompilations(), 
+                       sourcePaths);
+        
+        move_optimizer::ActionConfig config = makeActionConfig(run);
+        config.output = &output;
+        config.candidates = reportingCandidates() ? &candidates : nullptr;
+        move_optimizer::MoveOptimizerActionFactory Factory(llvm::outs(), llvm::errs(), stats,
+                                                           config);
+        status = Tool.run(&Factory);
+    }
+
+    if (cache) {
+        cache->prune();
+        decisionStore->save();
+    }
+    if (reportingCandidates()) {
+        move_optimizer::printCandidateReport(std::move(candidates), llvm::outs());
+    }
+    if (PrintStats) {
+        printStats(stats);
+    }
+    if (!TimeTrace.empty()) {
+        if (llvm::Error traceErr = llvm::timeTraceProfilerWrite(TimeTrace, "move-optimizer")) {
+            llvm::errs() << "Error writing " << TimeTrace << ": "
+                         << llvm::toString(std::move(traceErr)) << "\n";
+            status = move_optimizer::combineStatus(status, 1);
+        }
+        llvm::timeTraceProfilerCleanup();
+    }
+    return status;
 }
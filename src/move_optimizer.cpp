@@ -1,13 +1,67 @@
 #include "move_optimizer.h"
 #include <clang/AST/ASTContext.h>
+#include <clang/AST/Mangle.h>
+#include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/Rewrite/Core/Rewriter.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 
 namespace move_optimizer {
 
-MoveOptimizer::MoveOptimizer(clang::ASTContext& context, clang::Rewriter& rewriter)
-    : context_(context), rewriter_(rewriter) {
+namespace {
+
+// Functions referred to other than as the callee of a call: their address
+// is taken or they are bound to a reference, so their type has to stay.
+class NonCallReferences : public clang::RecursiveASTVisitor<NonCallReferences> {
+public:
+    bool VisitCallExpr(clang::CallExpr* call) {
+        if (call->getCallee()) {
+            callees_.insert(call->getCallee()->IgnoreParenImpCasts());
+        }
+        return true;
+    }
+    bool VisitDeclRefExpr(clang::DeclRefExpr* ref) {
+        note(ref, ref->getDecl());
+        return true;
+    }
+    bool VisitMemberExpr(clang::MemberExpr* member) {
+        note(member, member->getMemberDecl());
+        return true;
+    }
+    bool VisitOverloadExpr(clang::OverloadExpr* overload) {
+        for (const clang::NamedDecl* decl : overload->decls()) {
+            note(overload, decl);
+        }
+        return true;
+    }
+
+    bool contains(const clang::FunctionDecl* function) const {
+        return functions_.contains(function->getCanonicalDecl());
+    }
+
+private:
+    void note(const clang::Expr* expr, const clang::NamedDecl* decl) {
+        const auto* function =
+            llvm::dyn_cast_or_null<clang::FunctionDecl>(decl ? decl->getUnderlyingDecl() : nullptr);
+        if (function && !callees_.contains(expr)) {
+            functions_.insert(function->getCanonicalDecl());
+        }
+    }
+
+    // Calls are visited before their callee.
+    llvm::DenseSet<const clang::Expr*> callees_;
+    llvm::DenseSet<const clang::FunctionDecl*> functions_;
+};
+
+} // namespace
+
+MoveOptimizer::MoveOptimizer(clang::ASTContext& context, clang::Rewriter* rewriter)
+    : context_(context), rewriter_(rewriter), decisionStore_(nullptr), minCopyCost_(0),
+      profile_(nullptr), minFunctionCount_(0), sinkParams_(SignatureChanges::Off),
+      readOnlyParams_(SignatureChanges::Off) {
     transformer_ = std::make_unique<CodeTransformer>(context_, rewriter_);
 }
 
@@ -18,13 +72,34 @@ MoveOptimizer::~MoveOptimizer() {
 bool MoveOptimizer::processAST(clang::ASTContext& context) {
     if (!astVisitor_) {
         astVisitor_ = std::make_unique<ASTVisitor>(context);
+        astVisitor_->setDecisionStore(decisionStore_);
+        astVisitor_->setEmplaceContainers(emplaceContainers_);
+        astVisitor_->setSinkParams(sinkParams_);
+        astVisitor_->setReadOnlyParams(readOnlyParams_);
     }
     
     // Traverse the AST
+    llvm::TimeTraceScope scope("AnalyzeAST");
     astVisitor_->TraverseDecl(context.getTranslationUnitDecl());
     
     // Collect transformations
     transformations_ = astVisitor_->getTransformations();
+    holdBackUnsafeSignatureChanges(context);
+    if (profile_) {
+        // Mangling is not free and functions usually have several candidates.
+        std::unique_ptr<clang::MangleContext> mangler(context.createMangleContext());
+        llvm::DenseMap<const clang::FunctionDecl*, uint64_t> counts;
+        for (Transformation& transformation : transformations_) {
+            if (!transformation.function) {
+                continue;
+            }
+            auto inserted = counts.try_emplace(transformation.function, 0);
+            if (inserted.second) {
+                inserted.first->second = profile_->countFor(transformation.function, *mangler);
+            }
+            transformation.executionCount = inserted.first->second;
+        }
+    }
     
     return true;
 }
@@ -33,8 +108,94 @@ bool MoveOptimizer::applyTransformations() {
     if (!transformer_) {
         transformer_ = std::make_unique<CodeTransformer>(context_, rewriter_);
     }
-    
-    return transformer_->applyTransformations(transformations_);
+
+    llvm::TimeTraceScope scope("ApplyTransformations");
+    const bool proposals = sinkParams_ != SignatureChanges::Off ||
+                           readOnlyParams_ != SignatureChanges::Off;
+    if (minCopyCost_ == 0 && minFunctionCount_ == 0 && !proposals) {
+        return transformer_->applyTransformations(transformations_);
+    }
+    std::vector<Transformation> worthwhile;
+    for (const Transformation& transformation : transformations_) {
+        if (transformation.copyCost >= minCopyCost_ &&
+            transformation.executionCount >= minFunctionCount_ &&
+            !isProposalOnly(transformation)) {
+            worthwhile.push_back(transformation);
+        }
+    }
+    return transformer_->applyTransformations(worthwhile);
+}
+
+void MoveOptimizer::holdBackUnsafeSignatureChanges(clang::ASTContext& context) {
+    // Depends on the whole unit, so it is never part of a stored decision.
+    if (std::none_of(transformations_.begin(), transformations_.end(),
+                     [this](const Transformation& transformation) {
+                         return isSignatureChange(transformation.type) &&
+                                !isProposalOnly(transformation);
+                     })) {
+        return;
+    }
+
+    NonCallReferences references;
+    references.TraverseDecl(context.getTranslationUnitDecl());
+    const clang::SourceManager& sm = context.getSourceManager();
+    // Another unit may declare a function with external linkage itself, and
+    // would no longer link; one declared only in an editable header sees
+    // the new signature.
+    auto onlyInEditableHeaders = [&](const clang::FunctionDecl* function) {
+        return llvm::all_of(function->redecls(), [&](const clang::FunctionDecl* redecl) {
+            const clang::SourceLocation loc = sm.getExpansionLoc(redecl->getLocation());
+            return !sm.isInMainFile(loc) && transformer_->isEditableFile(loc);
+        });
+    };
+    llvm::DenseMap<const clang::FunctionDecl*, const char*> reasons;
+    for (Transformation& transformation : transformations_) {
+        if (!isSignatureChange(transformation.type) || !transformation.function) {
+            continue;
+        }
+        auto inserted = reasons.try_emplace(transformation.function, nullptr);
+        if (inserted.second) {
+            const clang::FunctionDecl* function = transformation.function;
+            if (references.contains(function)) {
+                inserted.first->second = "proposed, the function is used other than by calls";
+            } else if (function->isExternallyVisible() && !onlyInEditableHeaders(function)) {
+                inserted.first->second =
+                    "proposed, the function has external linkage and is declared outside "
+                    "editable headers";
+            }
+        }
+        transformation.reportOnly = inserted.first->second;
+    }
+}
+
+bool MoveOptimizer::isProposalOnly(const Transformation& transformation) const {
+    if (transformation.reportOnly) {
+        return true;
+    }
+    switch (transformation.type) {
+        case Transformation::SINK_PARAM_BY_VALUE:
+        case Transformation::SINK_PARAM_MOVE:
+            return sinkParams_ == SignatureChanges::Report;
+        case Transformation::READONLY_PARAM_BY_REF:
+            return readOnlyParams_ == SignatureChanges::Report;
+        default:
+            return false;
+    }
+}
+
+AnalysisStats MoveOptimizer::getAnalysisStats() const {
+    AnalysisStats stats = astVisitor_ ? astVisitor_->getStats() : AnalysisStats();
+    stats.candidates = transformations_.size();
+    stats.movesApplied = transformer_->getMovesApplied();
+    return stats;
+}
+
+const FileEdits& MoveOptimizer::getReplacements() const {
+    return transformer_->getReplacements();
+}
+
+bool MoveOptimizer::hasCompleteReplacements() const {
+    return transformer_->hasCompleteReplacements();
 }
 
 } // namespace move_optimizer
@@ -0,0 +1,437 @@
+#include "optimizer_action.h"
+#include "move_optimizer.h"
+#include <clang/AST/ASTConsumer.h>
+#include <clang/AST/ASTContext.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Lex/Lexer.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/TimeProfiler.h>
+#include <algorithm>
+#include <system_error>
+
+namespace move_optimizer {
+
+namespace {
+
+// Collects every file the unit reads, system headers included, since any of
+// them can change what the optimizer decides.
+class UnitDependencyCollector : public clang::DependencyCollector {
+public:
+    bool needSystemDependencies() override { return true; }
+};
+
+// Name of a transformation type in --report-candidates
+const char* candidateKind(Transformation::Type type) {
+    switch (type) {
+        case Transformation::RETURN_VALUE_MOVE:
+            return "return";
+        case Transformation::FUNCTION_ARG_MOVE:
+            return "argument";
+        case Transformation::VARIABLE_ASSIGNMENT_MOVE:
+            return "assignment";
+        case Transformation::CONSTRUCTOR_INIT_MOVE:
+            return "initializer";
+        case Transformation::EMPLACE_INSERT:
+        case Transformation::TRY_EMPLACE_INSERT:
+            return "emplace";
+        case Transformation::SINK_PARAM_BY_VALUE:
+            return "by-value sink parameter";
+        case Transformation::SINK_PARAM_MOVE:
+            return "sink parameter move";
+        case Transformation::READONLY_PARAM_BY_REF:
+            return "read-only by-value parameter";
+        case Transformation::RANGE_FOR_CONST_REF:
+            return "range-for copy";
+        case Transformation::RANGE_FOR_CONSUME:
+            return "range-for consuming copy";
+    }
+    return "move";
+}
+
+// Why a signature change was only listed, or null if it was applied
+const char* proposalReason(const Transformation& transformation, const ActionConfig& config) {
+    switch (transformation.type) {
+        case Transformation::SINK_PARAM_BY_VALUE:
+        case Transformation::SINK_PARAM_MOVE:
+            return config.sinkParams == SignatureChanges::Report
+                       ? "proposed, apply with --sink-params=rewrite"
+                       : transformation.reportOnly;
+        case Transformation::READONLY_PARAM_BY_REF:
+            return config.readOnlyParams == SignatureChanges::Report
+                       ? "proposed, apply with --readonly-params=rewrite"
+                       : transformation.reportOnly;
+        default:
+            return nullptr;
+    }
+}
+
+class MoveOptimizerConsumer : public clang::ASTConsumer {
+public:
+    MoveOptimizerConsumer(clang::Rewriter* rewriter, llvm::raw_ostream& err,
+                          AnalysisStats& stats, const ActionConfig& config)
+        : rewriter_(rewriter), err_(err), stats_(stats), config_(config) {}
+
+    void HandleTranslationUnit(clang::ASTContext& context) override {
+        MoveOptimizer optimizer(context, rewriter_);
+        optimizer.setDecisionStore(config_.decisionStore);
+        optimizer.setHeaderRoot(config_.headerRoot);
+        optimizer.setMinCopyCost(config_.minCopyCost);
+        optimizer.setProfile(config_.profile, config_.minFunctionCount);
+        optimizer.setEmplaceContainers(config_.emplaceContainers);
+        optimizer.setSinkParams(config_.sinkParams);
+        optimizer.setReadOnlyParams(config_.readOnlyParams);
+        if (!optimizer.processAST(context)) {
+            err_ << "Error processing AST\n";
+            return;
+        }
+
+        const bool applied = optimizer.applyTransformations();
+        stats_ += optimizer.getAnalysisStats();
+        if (!applied) {
+            err_ << "Error applying transformations\n";
+            return;
+        }
+
+        if (config_.record) {
+            config_.record->edits = optimizer.getReplacements();
+            config_.record->complete = optimizer.hasCompleteReplacements();
+        }
+        if (config_.candidates) {
+            reportCandidates(context, optimizer.getTransformations());
+        }
+    }
+
+    // Only consulted when FrontendOptions::SkipFunctionBodies is set. Sema
+    // still parses bodies it needs, such as constexpr ones.
+    bool shouldSkipFunctionBody(clang::Decl* decl) override {
+        return move_optimizer::shouldSkipFunctionBody(config_.skipBodies, decl);
+    }
+
+private:
+    // Only candidates in files that may be edited are worth reporting.
+    void reportCandidates(clang::ASTContext& context,
+                          const std::vector<Transformation>& transformations) {
+        const clang::SourceManager& sm = context.getSourceManager();
+        for (const Transformation& transformation : transformations) {
+            const clang::SourceLocation loc = sm.getExpansionLoc(transformation.location);
+            if (!sm.isInMainFile(loc) &&
+                (config_.headerRoot.empty() || sm.isInSystemHeader(loc))) {
+                continue;
+            }
+            CandidateReport report;
+            report.location = loc.printToString(sm);
+            report.kind = candidateKind(transformation.type);
+            if (transformation.function) {
+                report.function = transformation.function->getQualifiedNameAsString();
+            }
+            report.expression = clang::Lexer::getSourceText(
+                clang::CharSourceRange::getTokenRange(transformation.range), sm,
+                context.getLangOpts()).str();
+            report.copyCost = transformation.copyCost;
+            if (config_.profile) {
+                report.executionCount = transformation.executionCount;
+            }
+            if (transformation.copyCost < config_.minCopyCost) {
+                report.skipped = "below --min-copy-cost";
+            } else if (transformation.executionCount < config_.minFunctionCount) {
+                report.skipped = "below --min-function-count";
+            } else if (const char* reason = proposalReason(transformation, config_)) {
+                report.skipped = reason;
+            }
+            config_.candidates->push_back(std::move(report));
+        }
+    }
+
+    clang::Rewriter* rewriter_;
+    llvm::raw_ostream& err_;
+    AnalysisStats& stats_;
+    const ActionConfig& config_;
+};
+
+} // namespace
+
+bool shouldSkipFunctionBody(BodySkipping policy, const clang::Decl* decl) {
+    const clang::SourceManager& sm = decl->getASTContext().getSourceManager();
+    const clang::SourceLocation loc = sm.getExpansionLoc(decl->getLocation());
+    switch (policy) {
+        case BodySkipping::SystemHeaders:
+            return sm.isInSystemHeader(loc);
+        case BodySkipping::Headers:
+            return !sm.isInMainFile(loc);
+        case BodySkipping::None:
+            break;
+    }
+    return false;
+}
+
+int combineStatus(int current, int next) {
+    if (current == 1 || next == 1) {
+        return 1;
+    }
+    return std::max(current, next);
+}
+
+std::string outputPathFor(const OutputOptions& options, llvm::StringRef inputFile) {
+    if (options.inPlace) {
+        return inputFile.str();
+    }
+    if (!options.outputFile.empty()) {
+        return options.outputFile;
+    }
+    if (options.outputDir.empty()) {
+        return inputFile.str() + ".optimized";
+    }
+
+    llvm::SmallString<256> outputPathBuf(options.outputDir);
+    llvm::sys::path::append(outputPathBuf, llvm::sys::path::filename(inputFile));
+    outputPathBuf += ".optimized";
+    return outputPathBuf.str().str();
+}
+
+bool writeFileAtomically(llvm::StringRef path,
+                         llvm::function_ref<void(llvm::raw_ostream&)> write,
+                         llvm::raw_ostream& err, uint64_t* bytesWritten) {
+    llvm::TimeTraceScope scope("WriteFile", path);
+    llvm::SmallString<256> parentDir(path);
+    llvm::sys::path::remove_filename(parentDir);
+    if (!parentDir.empty()) {
+        std::error_code dirEc = llvm::sys::fs::create_directories(parentDir);
+        if (dirEc) {
+            err << "Error creating output directory: " << dirEc.message() << "\n";
+            return false;
+        }
+    }
+
+    llvm::SmallString<256> tempPath;
+    int fd = -1;
+    if (std::error_code EC = llvm::sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, tempPath)) {
+        err << "Error opening output file: " << EC.message() << "\n";
+        return false;
+    }
+    uint64_t size = 0;
+    {
+        llvm::raw_fd_ostream OS(fd, /*shouldClose=*/true);
+        write(OS);
+        size = OS.tell();
+        OS.close();
+        if (OS.has_error()) {
+            err << "Error writing output file: " << OS.error().message() << "\n";
+            OS.clear_error();
+            llvm::sys::fs::remove(tempPath);
+            return false;
+        }
+    }
+
+    // An overwritten file keeps its mode, which matters for --in-place.
+    llvm::sys::fs::file_status existing;
+    if (!llvm::sys::fs::status(path, existing)) {
+        llvm::sys::fs::setPermissions(tempPath, existing.permissions());
+    }
+    if (std::error_code EC = llvm::sys::fs::rename(tempPath, path)) {
+        err << "Error writing output file: " << EC.message() << "\n";
+        llvm::sys::fs::remove(tempPath);
+        return false;
+    }
+    if (bytesWritten) {
+        *bytesWritten += size;
+    }
+    return true;
+}
+
+namespace {
+
+// A unit without edits only gets an output file when -o asks for one. An
+// output left over from an earlier run would no longer match the input.
+void writeUnchanged(const OutputOptions& options, llvm::StringRef inputFile,
+                    llvm::StringRef contents, llvm::raw_ostream& out, llvm::raw_ostream& err,
+                    uint64_t* bytesWritten) {
+    if (!options.outputFile.empty() && !options.inPlace) {
+        if (writeFileAtomically(options.outputFile,
+                                [&](llvm::raw_ostream& OS) { OS << contents; }, err,
+                                bytesWritten)) {
+            out << "Optimized: " << inputFile << " -> " << options.outputFile << "\n";
+        }
+        return;
+    }
+    if (!options.inPlace) {
+        llvm::sys::fs::remove(outputPathFor(options, inputFile));
+    }
+    out << "Unchanged: " << inputFile << "\n";
+}
+
+} // namespace
+
+bool writeEditedFile(const OutputOptions& options, llvm::StringRef mainFile,
+                     const FileEdits& edits,
+                     llvm::raw_ostream& out, llvm::raw_ostream& err, uint64_t* bytesWritten) {
+    auto source = llvm::MemoryBuffer::getFile(mainFile);
+    if (!source) {
+        return false;
+    }
+
+    auto mainFileEdits = edits.find(mainFile.str());
+    if (mainFileEdits == edits.end() || mainFileEdits->second.empty()) {
+        writeUnchanged(options, mainFile, (*source)->getBuffer(), out, err, bytesWritten);
+        return true;
+    }
+
+    llvm::Expected<std::string> code =
+        clang::tooling::applyAllReplacements((*source)->getBuffer(), mainFileEdits->second);
+    if (!code) {
+        llvm::consumeError(code.takeError());
+        return false;
+    }
+
+    const std::string outputPath = outputPathFor(options, mainFile);
+    if (writeFileAtomically(outputPath, [&](llvm::raw_ostream& OS) { OS << *code; }, err,
+                            bytesWritten)) {
+        out << "Optimized: " << mainFile << " -> " << outputPath << "\n";
+    }
+    return true;
+}
+
+void HeaderEditCollector::add(llvm::StringRef mainFile, const FileEdits& edits) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& fileEdits : edits) {
+        if (fileEdits.first == mainFile || fileEdits.second.empty()) {
+            continue;
+        }
+        edits_[fileEdits.first].insert(fileEdits.second.begin(), fileEdits.second.end());
+    }
+}
+
+int HeaderEditCollector::write(const OutputOptions& options, llvm::raw_ostream& out,
+                               llvm::raw_ostream& err, uint64_t* bytesWritten) {
+    // -o names the output of the single main file, never that of a header.
+    OutputOptions headerOptions = options;
+    headerOptions.outputFile.clear();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    int status = 0;
+    for (const auto& header : edits_) {
+        FileEdits merged;
+        clang::tooling::Replacements& headerEdits = merged[header.first];
+        bool conflict = false;
+        for (const clang::tooling::Replacement& edit : header.second) {
+            if (llvm::Error addErr = headerEdits.add(edit)) {
+                llvm::consumeError(std::move(addErr));
+                conflict = true;
+                break;
+            }
+        }
+        if (conflict) {
+            err << "Warning: units disagree on the edits to " << header.first
+                << "; header left unchanged\n";
+            continue;
+        }
+        if (!writeEditedFile(headerOptions, header.first, merged, out, err, bytesWritten)) {
+            err << "Error: edits for " << header.first << " no longer apply\n";
+            status = 1;
+        }
+    }
+    return status;
+}
+
+uint64_t CandidateReport::weight() const {
+    return executionCount ? llvm::SaturatingMultiply(copyCost, *executionCount) : copyCost;
+}
+
+void printCandidateReport(std::vector<CandidateReport> candidates, llvm::raw_ostream& os) {
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const CandidateReport& lhs, const CandidateReport& rhs) {
+                         return lhs.weight() > rhs.weight();
+                     });
+    const bool profiled = llvm::any_of(candidates, [](const CandidateReport& candidate) {
+        return candidate.executionCount.has_value();
+    });
+    os << (profiled ? "=== move candidates by copy cost times execution count ===\n"
+                    : "=== move candidates by estimated copy cost ===\n");
+    std::set<std::pair<std::string, std::string>> printed;
+    for (const CandidateReport& candidate : candidates) {
+        if (!printed.insert({candidate.location, candidate.expression}).second) {
+            continue;
+        }
+        os << llvm::format("%8llu  ", static_cast<unsigned long long>(candidate.weight()))
+           << candidate.location << "  " << candidate.kind << " '" << candidate.expression
+           << "' in " << candidate.function;
+        if (candidate.executionCount) {
+            os << " (cost " << candidate.copyCost << ", count " << *candidate.executionCount
+               << ")";
+        }
+        if (candidate.skipped) {
+            os << " (" << candidate.skipped << ")";
+        }
+        os << "\n";
+    }
+}
+
+MoveOptimizerAction::MoveOptimizerAction(llvm::raw_ostream& out, llvm::raw_ostream& err,
+                                         AnalysisStats& stats, ActionConfig config)
+    : rewriter_(nullptr), out_(out), err_(err), stats_(stats), config_(config) {
+}
+
+bool MoveOptimizerAction::BeginSourceFileAction(clang::CompilerInstance& CI) {
+    if (config_.skipBodies != BodySkipping::None) {
+        CI.getFrontendOpts().SkipFunctionBodies = true;
+    }
+    if (config_.record && config_.collectDependencies) {
+        dependencies_ = std::make_shared<UnitDependencyCollector>();
+        dependencies_->attachToPreprocessor(CI.getPreprocessor());
+    }
+    return true;
+}
+
+std::unique_ptr<clang::ASTConsumer> MoveOptimizerAction::CreateASTConsumer(
+    clang::CompilerInstance& CI, llvm::StringRef file) {
+    // Runs that only keep the edits do not need a rewrite buffer.
+    if (config_.output) {
+        rewriter_ = std::make_unique<clang::Rewriter>(CI.getSourceManager(), CI.getLangOpts());
+    }
+    return std::make_unique<MoveOptimizerConsumer>(rewriter_.get(), err_, stats_, config_);
+}
+
+void MoveOptimizerAction::EndSourceFileAction() {
+    if (dependencies_) {
+        llvm::ArrayRef<std::string> files = dependencies_->getDependencies();
+        config_.record->dependencies.assign(files.begin(), files.end());
+        if (llvm::find(files, getCurrentFile()) == files.end()) {
+            config_.record->dependencies.push_back(getCurrentFile().str());
+        }
+    }
+
+    if (!config_.output || !rewriter_) {
+        return;
+    }
+    llvm::TimeTraceScope scope("WriteOutput", getCurrentFile());
+
+    // A relative main file is relative to the compile command's directory,
+    // which the tool's file system works in but the process need not.
+    clang::CompilerInstance& CI = getCompilerInstance();
+    llvm::SmallString<256> mainFile(getCurrentFile());
+    CI.getFileManager().getVirtualFileSystem().makeAbsolute(mainFile);
+    llvm::sys::path::remove_dots(mainFile);
+
+    const clang::SourceManager& SM = CI.getSourceManager();
+    const clang::RewriteBuffer* buffer = rewriter_->getRewriteBufferFor(SM.getMainFileID());
+    if (!buffer) {
+        writeUnchanged(*config_.output, mainFile,
+                       SM.getBufferData(SM.getMainFileID()), out_, err_, &stats_.bytesWritten);
+        return;
+    }
+
+    // Stream the rewritten file straight from the rewrite buffer.
+    const std::string outputPath = outputPathFor(*config_.output, mainFile);
+    if (writeFileAtomically(outputPath, [&](llvm::raw_ostream& OS) { buffer->write(OS); },
+                            err_, &stats_.bytesWritten)) {
+        out_ << "Optimized: " << mainFile << " -> " << outputPath << "\n";
+    }
+}
+
+} // namespace move_optimizer
@@ -0,0 +1,451 @@
+#include "preamble_server.h"
+#include "result_cache.h"
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Frontend/Utils.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Tooling/ArgumentsAdjusters.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tuple>
+#include <unistd.h>
+
+namespace move_optimizer {
+
+namespace {
+
+// Every message is framed as "<size>\n<payload>". Requests are
+// "optimize <absolute path>" or "shutdown"; an optimize reply is
+//   status <n>
+//   diagnostics <size>\n<text>
+// followed by the edits for the file (see writeEdit).
+
+#ifdef MSG_NOSIGNAL
+constexpr int SendFlags = MSG_NOSIGNAL;     // A vanished peer must not kill the server
+#else
+constexpr int SendFlags = 0;
+#endif
+
+bool sendMessage(int fd, llvm::StringRef payload) {
+    std::string frame = std::to_string(payload.size()) + "\n";
+    frame += payload;
+    const char* data = frame.data();
+    size_t remaining = frame.size();
+    while (remaining > 0) {
+        ssize_t sent = ::send(fd, data, remaining, SendFlags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += sent;
+        remaining -= sent;
+    }
+    return true;
+}
+
+bool receiveBytes(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t received = ::recv(fd, data, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+bool receiveMessage(int fd, std::string& payload) {
+    std::string header;
+    char c = 0;
+    while (receiveBytes(fd, &c, 1)) {
+        if (c == '\n') {
+            uint64_t size = 0;
+            if (llvm::StringRef(header).getAsInteger(10, size)) {
+                return false;
+            }
+            payload.resize(size);
+            return receiveBytes(fd, &payload[0], size);
+        }
+        if (header.size() > 20) {
+            return false;
+        }
+        header += c;
+    }
+    return false;
+}
+
+bool makeSocketAddress(llvm::StringRef socketPath, sockaddr_un& address) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::memcpy(address.sun_path, socketPath.data(), socketPath.size());
+    return true;
+}
+
+// Applies the server's body skipping to the headers in a preamble
+class PreambleBuildCallbacks : public clang::PreambleCallbacks {
+public:
+    explicit PreambleBuildCallbacks(BodySkipping skipBodies) : skipBodies_(skipBodies) {}
+
+    bool shouldSkipFunctionBody(clang::Decl* decl) override {
+        return move_optimizer::shouldSkipFunctionBody(skipBodies_, decl);
+    }
+
+private:
+    BodySkipping skipBodies_;
+};
+
+std::string encodeReply(int status, llvm::StringRef diagnostics,
+                        const FileEdits& edits,
+                        const clang::tooling::CompileCommand* command) {
+    std::string reply;
+    llvm::raw_string_ostream os(reply);
+    os << "status " << status << "\n"
+       << "diagnostics " << diagnostics.size() << "\n" << diagnostics;
+    for (const auto& fileEdits : edits) {
+        const std::string path =
+            command ? absolutePathFor(*command, fileEdits.first) : fileEdits.first;
+        for (const clang::tooling::Replacement& edit : fileEdits.second) {
+            writeEdit(os, path, edit);
+        }
+    }
+    os.flush();
+    return reply;
+}
+
+bool decodeReply(llvm::StringRef reply, int& status, std::string& diagnostics,
+                 FileEdits& edits) {
+    llvm::StringRef line;
+    std::tie(line, reply) = reply.split('\n');
+    if (!line.consume_front("status ") || line.getAsInteger(10, status)) {
+        return false;
+    }
+
+    uint64_t size = 0;
+    std::tie(line, reply) = reply.split('\n');
+    if (!line.consume_front("diagnostics ") || line.getAsInteger(10, size) ||
+        reply.size() < size) {
+        return false;
+    }
+    diagnostics = reply.take_front(size).str();
+    reply = reply.drop_front(size);
+
+    while (!reply.empty()) {
+        std::tie(line, reply) = reply.split('\n');
+        if (!line.consume_front("edit ") || !readEdit(line, reply, edits)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Makes way for binding to path. Only a socket nobody listens on, left
+// behind by a server that did not shut down, is removed; anything else at
+// path is reported and kept.
+bool clearSocketPath(llvm::StringRef path, const sockaddr_un& address) {
+    llvm::sys::fs::file_status status;
+    if (std::error_code ec = llvm::sys::fs::status(path, status)) {
+        if (ec == std::errc::no_such_file_or_directory) {
+            return true;
+        }
+        llvm::errs() << "Error: cannot check " << path << ": " << ec.message() << "\n";
+        return false;
+    }
+    if (status.type() != llvm::sys::fs::file_type::socket_file) {
+        llvm::errs() << "Error: " << path << " exists and is not a socket\n";
+        return false;
+    }
+
+    int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0) {
+        llvm::errs() << "Error creating socket: " << std::strerror(errno) << "\n";
+        return false;
+    }
+    const bool listening =
+        ::connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    ::close(probe);
+    if (listening) {
+        llvm::errs() << "Error: a server is already listening on " << path << "\n";
+        return false;
+    }
+    if (std::error_code ec = llvm::sys::fs::remove(path)) {
+        llvm::errs() << "Error removing stale socket " << path << ": " << ec.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+PreambleServer::PreambleServer(const clang::tooling::CompilationDatabase& compilations,
+                               const ActionConfig& settings, size_t maxPreambles)
+    : compilations_(compilations),
+      settings_(settings),
+      maxPreambles_(maxPreambles),
+      pchOperations_(std::make_shared<clang::PCHContainerOperations>()) {
+}
+
+int PreambleServer::serve(llvm::StringRef socketPath) {
+    sockaddr_un address;
+    if (!makeSocketAddress(socketPath, address)) {
+        llvm::errs() << "Error: socket path is too long: " << socketPath << "\n";
+        return 1;
+    }
+
+    // A socket left behind by a previous server would make bind fail.
+    if (!clearSocketPath(socketPath, address)) {
+        return 1;
+    }
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        llvm::errs() << "Error creating socket: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        ::listen(listener, 8) < 0) {
+        llvm::errs() << "Error listening on " << socketPath << ": " << std::strerror(errno) << "\n";
+        ::close(listener);
+        return 1;
+    }
+
+    bool running = true;
+    while (running) {
+        int connection = ::accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        std::string request;
+        while (receiveMessage(connection, request)) {
+            llvm::StringRef command(request);
+            std::string reply;
+            if (command == "shutdown") {
+                running = false;
+                reply = "ok";
+            } else if (command.consume_front("optimize ")) {
+                reply = optimize(command);
+            } else {
+                reply = encodeReply(1, "Error: unknown request\n", {}, nullptr);
+            }
+            if (!sendMessage(connection, reply) || !running) {
+                break;
+            }
+        }
+        ::close(connection);
+    }
+
+    ::close(listener);
+    llvm::sys::fs::remove(socketPath);
+    return 0;
+}
+
+std::string PreambleServer::optimize(llvm::StringRef file) {
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<clang::tooling::CompileCommand> commands = compilations_.getCompileCommands(file);
+    if (commands.empty()) {
+        return encodeReply(2, "Skipping " + file.str() + ". Compile command not found.\n",
+                           {}, nullptr);
+    }
+    const clang::tooling::CompileCommand& command = commands.front();
+
+    // Same adjustments as ClangTool, including its resource directory.
+    static int StaticSymbol;
+    clang::tooling::ArgumentsAdjuster adjuster = clang::tooling::combineAdjusters(
+        clang::tooling::getClangStripOutputAdjuster(),
+        clang::tooling::combineAdjusters(clang::tooling::getClangSyntaxOnlyAdjuster(),
+                                         clang::tooling::getClangStripDependencyFileAdjuster()));
+    std::vector<std::string> args = adjuster(command.CommandLine, command.Filename);
+    args.push_back("-resource-dir=" +
+                   clang::CompilerInvocation::GetResourcesPath("move-optimizer", &StaticSymbol));
+
+    std::string diagnostics;
+    llvm::raw_string_ostream diagStream(diagnostics);
+    llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> diagOpts = new clang::DiagnosticOptions();
+    clang::TextDiagnosticPrinter diagPrinter(diagStream, diagOpts.get());
+    llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diags =
+        clang::CompilerInstance::createDiagnostics(diagOpts.get(), &diagPrinter,
+                                                   /*ShouldOwnClient=*/false);
+
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> vfs = llvm::vfs::createPhysicalFileSystem();
+    vfs->setCurrentWorkingDirectory(command.Directory);
+
+    std::vector<const char*> argv;
+    argv.reserve(args.size());
+    for (const std::string& arg : args) {
+        argv.push_back(arg.c_str());
+    }
+    clang::CreateInvocationOptions invocationOptions;
+    invocationOptions.Diags = diags;
+    invocationOptions.VFS = vfs;
+    std::shared_ptr<clang::CompilerInvocation> invocation =
+        clang::createInvocation(argv, invocationOptions);
+    if (!invocation || invocation->getFrontendOpts().Inputs.size() != 1) {
+        diagStream.flush();
+        return encodeReply(1, diagnostics + "Error creating compiler invocation\n", {}, nullptr);
+    }
+
+    const std::string mainFile = absolutePathFor(command, command.Filename);
+    auto buffer = vfs->getBufferForFile(mainFile);
+    if (!buffer) {
+        return encodeReply(1, "Error reading " + mainFile + "\n", {}, nullptr);
+    }
+
+    // The preamble only covers the leading #include block, so edits below it
+    // keep the preamble valid.
+    std::string key = command.Directory;
+    for (const std::string& arg : args) {
+        key += '\0';
+        key += arg;
+    }
+    if (settings_.skipBodies != BodySkipping::None) {
+        invocation->getFrontendOpts().SkipFunctionBodies = true;
+    }
+    const clang::PreambleBounds bounds = clang::ComputePreambleBounds(
+        invocation->getLangOpts(), (*buffer)->getMemBufferRef(), 0);
+    clang::PrecompiledPreamble* preamble = findPreamble(key);
+    const bool reused =
+        preamble && preamble->CanReuse(*invocation, (*buffer)->getMemBufferRef(), bounds, *vfs);
+    if (!reused) {
+        PreambleBuildCallbacks callbacks(settings_.skipBodies);
+        llvm::ErrorOr<clang::PrecompiledPreamble> built = clang::PrecompiledPreamble::Build(
+            *invocation, buffer->get(), bounds, *diags, vfs, pchOperations_,
+            /*StoreInMemory=*/true, /*StoragePath=*/"", callbacks);
+        preamble = nullptr;
+        if (built) {
+            storePreamble(key, std::make_unique<clang::PrecompiledPreamble>(std::move(*built)));
+            preamble = preambles_.front().preamble.get();
+        }
+    }
+    if (preamble) {
+        preamble->AddImplicitPreamble(*invocation, vfs, buffer->get());
+    }
+    invocation->getPreprocessorOpts().addRemappedFile(
+        invocation->getFrontendOpts().Inputs[0].getFile(), buffer->release());
+
+    clang::CompilerInstance compiler(pchOperations_);
+    compiler.setInvocation(invocation);
+    compiler.createDiagnostics(&diagPrinter, /*ShouldOwnClient=*/false);
+    compiler.createFileManager(vfs);
+
+    std::string out;
+    llvm::raw_string_ostream outStream(out);
+    UnitRecord record;
+    ActionConfig config = settings_;
+    config.output = nullptr;
+    config.record = &record;
+    config.collectDependencies = false;
+    config.candidates = nullptr;
+    MoveOptimizerAction action(outStream, diagStream, stats_, config);
+    int status = compiler.ExecuteAction(action) ? 0 : 1;
+    if (status == 0 && !record.complete) {
+        diagStream << "Error: not every edit in " << mainFile << " could be recorded\n";
+        status = 1;
+    }
+    diagStream.flush();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    llvm::errs() << "Served " << mainFile << " in " << elapsed.count() << " ms"
+                 << (reused ? " (warm preamble)" : preamble ? " (new preamble)" : "") << "\n";
+
+    return encodeReply(status, diagnostics,
+                       status == 0 ? record.edits : FileEdits(), &command);
+}
+
+clang::PrecompiledPreamble* PreambleServer::findPreamble(const std::string& key) {
+    for (auto it = preambles_.begin(); it != preambles_.end(); ++it) {
+        if (it->key == key) {
+            preambles_.splice(preambles_.begin(), preambles_, it);
+            return preambles_.front().preamble.get();
+        }
+    }
+    return nullptr;
+}
+
+void PreambleServer::storePreamble(const std::string& key,
+                                   std::unique_ptr<clang::PrecompiledPreamble> preamble) {
+    preambles_.remove_if([&key](const CachedPreamble& cached) { return cached.key == key; });
+    preambles_.push_front({key, std::move(preamble)});
+    while (preambles_.size() > maxPreambles_) {
+        preambles_.pop_back();
+    }
+}
+
+int runClient(llvm::StringRef socketPath, llvm::ArrayRef<std::string> files,
+              const OutputOptions& output, bool shutdownServer) {
+    sockaddr_un address;
+    if (!makeSocketAddress(socketPath, address)) {
+        llvm::errs() << "Error: socket path is too long: " << socketPath << "\n";
+        return 1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        llvm::errs() << "Error connecting to " << socketPath << ": " << std::strerror(errno) << "\n";
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return 1;
+    }
+
+    int status = 0;
+    std::string reply;
+    for (const std::string& file : files) {
+        llvm::SmallString<256> path(file);
+        llvm::sys::fs::make_absolute(path);
+        llvm::sys::path::remove_dots(path);
+
+        if (!sendMessage(fd, "optimize " + path.str().str()) || !receiveMessage(fd, reply)) {
+            llvm::errs() << "Error: lost connection to " << socketPath << "\n";
+            status = 1;
+            break;
+        }
+
+        int fileStatus = 1;
+        std::string diagnostics;
+        FileEdits edits;
+        if (!decodeReply(reply, fileStatus, diagnostics, edits)) {
+            llvm::errs() << "Error: malformed reply for " << path << "\n";
+            status = 1;
+            continue;
+        }
+        llvm::errs() << diagnostics;
+        if (fileStatus == 0 && !writeEditedFile(output, path, edits, llvm::outs(), llvm::errs())) {
+            llvm::errs() << "Error: edits for " << path << " no longer apply\n";
+            fileStatus = 1;
+        }
+        status = combineStatus(status, fileStatus);
+    }
+
+    if (shutdownServer) {
+        if (!sendMessage(fd, "shutdown") || !receiveMessage(fd, reply)) {
+            status = 1;
+        }
+    }
+    ::close(fd);
+    return status;
+}
+
+} // namespace move_optimizer
@@ -0,0 +1,60 @@
+#include "replacement_export.h"
+#include "optimizer_action.h"
+#include <clang/Tooling/ReplacementsYaml.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/YAMLTraits.h>
+#include <llvm/Support/xxhash.h>
+
+namespace move_optimizer {
+
+bool exportReplacementsYaml(llvm::StringRef directory, llvm::StringRef mainFile,
+                            const FileEdits& edits, llvm::raw_ostream& err) {
+    clang::tooling::TranslationUnitReplacements unit;
+    unit.MainSourceFile = mainFile.str();
+    for (const auto& fileEdits : edits) {
+        unit.Replacements.insert(unit.Replacements.end(), fileEdits.second.begin(),
+                                 fileEdits.second.end());
+    }
+    if (unit.Replacements.empty()) {
+        return true;
+    }
+
+    // Units with the same file name in different directories must not share
+    // a file, so the name carries a hash of the full path.
+    llvm::SmallString<256> path(directory);
+    llvm::sys::path::append(path, llvm::sys::path::filename(mainFile));
+    path += "_";
+    path += llvm::utohexstr(llvm::xxHash64(mainFile));
+    path += ".yaml";
+
+    return writeFileAtomically(path, [&](llvm::raw_ostream& OS) {
+        llvm::yaml::Output yaml(OS);
+        yaml << unit;
+    }, err);
+}
+
+std::string formatReplacementsJsonl(llvm::StringRef mainFile,
+                                    const FileEdits& edits) {
+    std::string lines;
+    llvm::raw_string_ostream OS(lines);
+    for (const auto& fileEdits : edits) {
+        for (const clang::tooling::Replacement& edit : fileEdits.second) {
+            llvm::json::OStream json(OS);
+            json.object([&]() {
+                json.attribute("tu", mainFile);
+                json.attribute("file", fileEdits.first);
+                json.attribute("offset", int64_t(edit.getOffset()));
+                json.attribute("length", int64_t(edit.getLength()));
+                json.attribute("text", edit.getReplacementText());
+            });
+            OS << "\n";
+        }
+    }
+    OS.flush();
+    return lines;
+}
+
+} // namespace move_optimizer
@@ -0,0 +1,254 @@
+#include "result_cache.h"
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+#include <algorithm>
+#include <chrono>
+#include <tuple>
+
+namespace move_optimizer {
+
+namespace {
+
+// Entry layout, one record per line:
+//   move-optimizer-cache 1
+//   file <size> <hash> <path>                     (every file the unit read)
+//   edit ...                                      (see writeEdit)
+constexpr llvm::StringLiteral EntryHeader = "move-optimizer-cache 1";
+constexpr llvm::StringLiteral EntrySuffix = ".entry";
+
+struct FileStamp {
+    uint64_t size;
+    uint64_t hash;
+};
+
+std::optional<FileStamp> stampFile(llvm::StringRef path) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        return std::nullopt;
+    }
+    llvm::StringRef data = (*buffer)->getBuffer();
+    return FileStamp{data.size(), llvm::xxHash64(data)};
+}
+
+bool takeBytes(llvm::StringRef& cursor, uint64_t count, llvm::StringRef& result) {
+    if (cursor.size() < count) {
+        return false;
+    }
+    result = cursor.take_front(count);
+    cursor = cursor.drop_front(count);
+    return true;
+}
+
+} // namespace
+
+std::string absolutePathFor(const clang::tooling::CompileCommand& command, llvm::StringRef path) {
+    llvm::SmallString<256> result(path);
+    llvm::sys::fs::make_absolute(command.Directory, result);
+    llvm::sys::path::remove_dots(result);
+    return std::string(result.str());
+}
+
+void writeEdit(llvm::raw_ostream& os, llvm::StringRef path,
+               const clang::tooling::Replacement& edit) {
+    os << "edit " << edit.getOffset() << " " << edit.getLength() << " " << path.size()
+       << " " << edit.getReplacementText().size() << "\n"
+       << path << edit.getReplacementText() << "\n";
+}
+
+bool readEdit(llvm::StringRef line, llvm::StringRef& cursor,
+              FileEdits& edits) {
+    llvm::SmallVector<llvm::StringRef, 4> fields;
+    line.split(fields, ' ');
+    unsigned offset = 0;
+    unsigned length = 0;
+    uint64_t pathSize = 0;
+    uint64_t textSize = 0;
+    if (fields.size() != 4 || fields[0].getAsInteger(10, offset) ||
+        fields[1].getAsInteger(10, length) || fields[2].getAsInteger(10, pathSize) ||
+        fields[3].getAsInteger(10, textSize)) {
+        return false;
+    }
+    llvm::StringRef filePath, text;
+    if (!takeBytes(cursor, pathSize, filePath) || !takeBytes(cursor, textSize, text) ||
+        !cursor.consume_front("\n")) {
+        return false;
+    }
+    clang::tooling::Replacement edit(filePath, offset, length, text);
+    if (llvm::Error err = edits[filePath.str()].add(edit)) {
+        llvm::consumeError(std::move(err));
+        return false;
+    }
+    return true;
+}
+
+ResultCache::ResultCache(std::string directory, uint64_t sizeLimitBytes, std::string toolIdentity)
+    : directory_(std::move(directory)),
+      sizeLimitBytes_(sizeLimitBytes),
+      toolIdentity_(std::move(toolIdentity)) {
+}
+
+std::optional<FileEdits> ResultCache::lookup(
+    const clang::tooling::CompileCommand& command) const {
+    const std::string path = entryPath(command);
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        return std::nullopt;
+    }
+
+    llvm::StringRef cursor = (*buffer)->getBuffer();
+    llvm::StringRef line;
+    std::tie(line, cursor) = cursor.split('\n');
+    if (line != EntryHeader) {
+        return std::nullopt;
+    }
+
+    FileEdits edits;
+    while (!cursor.empty()) {
+        std::tie(line, cursor) = cursor.split('\n');
+        if (line.consume_front("file ")) {
+            llvm::StringRef sizeText, hashText, filePath;
+            std::tie(sizeText, line) = line.split(' ');
+            std::tie(hashText, filePath) = line.split(' ');
+            uint64_t size = 0;
+            uint64_t hash = 0;
+            if (sizeText.getAsInteger(10, size) || hashText.getAsInteger(16, hash)) {
+                return std::nullopt;
+            }
+            std::optional<FileStamp> stamp = stampFile(filePath);
+            if (!stamp || stamp->size != size || stamp->hash != hash) {
+                return std::nullopt;
+            }
+        } else if (line.consume_front("edit ")) {
+            if (!readEdit(line, cursor, edits)) {
+                return std::nullopt;
+            }
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    // Refresh the entry so that pruning drops the least recently used ones.
+    int fd = -1;
+    if (!llvm::sys::fs::openFileForReadWrite(path, fd, llvm::sys::fs::CD_OpenExisting,
+                                             llvm::sys::fs::OF_None)) {
+        llvm::sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+        llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+    }
+
+    return edits;
+}
+
+void ResultCache::store(const clang::tooling::CompileCommand& command,
+                        const std::vector<std::string>& dependencies,
+                        const FileEdits& edits) const {
+    if (llvm::sys::fs::create_directories(directory_)) {
+        return;
+    }
+
+    std::string contents;
+    llvm::raw_string_ostream os(contents);
+    os << EntryHeader << "\n";
+    for (const std::string& dependency : dependencies) {
+        const std::string path = absolutePathFor(command, dependency);
+        std::optional<FileStamp> stamp = stampFile(path);
+        if (!stamp) {
+            return;
+        }
+        os << "file " << stamp->size << " " << llvm::utohexstr(stamp->hash) << " " << path << "\n";
+    }
+    for (const auto& fileEdits : edits) {
+        const std::string path = absolutePathFor(command, fileEdits.first);
+        for (const clang::tooling::Replacement& edit : fileEdits.second) {
+            writeEdit(os, path, edit);
+        }
+    }
+    os.flush();
+
+    // Write a temporary and rename it so that concurrent runs never read a
+    // partial entry.
+    const std::string finalPath = entryPath(command);
+    llvm::SmallString<256> tempPath;
+    int fd = -1;
+    if (llvm::sys::fs::createUniqueFile(finalPath + ".%%%%%%.tmp", fd, tempPath)) {
+        return;
+    }
+    {
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        out << contents;
+        out.close();
+        if (out.has_error()) {
+            out.clear_error();
+            llvm::sys::fs::remove(tempPath);
+            return;
+        }
+    }
+    if (llvm::sys::fs::rename(tempPath, finalPath)) {
+        llvm::sys::fs::remove(tempPath);
+    }
+}
+
+void ResultCache::prune() const {
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        llvm::sys::TimePoint<> modified;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t totalSize = 0;
+    std::error_code ec;
+    for (llvm::sys::fs::directory_iterator it(directory_, ec), end; it != end && !ec;
+         it.increment(ec)) {
+        if (!llvm::StringRef(it->path()).endswith(EntrySuffix)) {
+            continue;
+        }
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(it->path(), status)) {
+            continue;
+        }
+        entries.push_back({it->path(), status.getSize(), status.getLastModificationTime()});
+        totalSize += status.getSize();
+    }
+    if (totalSize <= sizeLimitBytes_) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+        return lhs.modified < rhs.modified;
+    });
+    for (const Entry& entry : entries) {
+        if (totalSize <= sizeLimitBytes_) {
+            break;
+        }
+        if (!llvm::sys::fs::remove(entry.path)) {
+            totalSize -= entry.size;
+        }
+    }
+}
+
+std::string ResultCache::entryPath(const clang::tooling::CompileCommand& command) const {
+    std::string key = toolIdentity_;
+    key += '\0';
+    key += command.Directory;
+    key += '\0';
+    key += command.Filename;
+    for (const std::string& arg : command.CommandLine) {
+        key += '\0';
+        key += arg;
+    }
+
+    llvm::SmallString<256> path(directory_);
+    llvm::sys::path::append(path, llvm::utohexstr(llvm::xxHash64(key)) + EntrySuffix.str());
+    return std::string(path.str());
+}
+
+} // namespace move_optimizer
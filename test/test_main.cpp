@@ -4,6 +4,8 @@
 #include <sstream>
 #include <cstdlib>
 #include <filesystem>
+#include <chrono>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -121,6 +123,108 @@ void g() {
     EXPECT_EQ(out.find("consume(std::move(local))"), std::string::npos);
 }
 
+TEST_F(MoveOptimizerTest, DoesNotMoveWhenFullExpressionReadsVariable) {
+    const std::string input = R"cpp(
+#include <string>
+int sink(std::string s) { return 0; }
+void outer(int result, size_t size) {}
+void g() {
+    std::string local = "hello";
+    outer(sink(local), local.size());
+}
+)cpp";
+    const fs::path inPath = writeTestFile("full_expr_input.cpp", input);
+    const fs::path outPath = testDir_ / "full_expr_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    EXPECT_EQ(out.find("std::move(local)"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, DoesNotMoveSingleUseInsideLoop) {
+    const std::string input = R"cpp(
+#include <string>
+void consume(std::string s) {}
+void loop(int n) {
+    std::string local = "hello";
+    for (int i = 0; i < n; ++i) {
+        consume(local);
+    }
+}
+)cpp";
+    const fs::path inPath = writeTestFile("loop_input.cpp", input);
+    const fs::path outPath = testDir_ / "loop_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    EXPECT_EQ(out.find("consume(std::move(local))"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, MovesLocalsThatAreRedeclaredOrReassigned) {
+    const std::string input = R"cpp(
+#include <string>
+void consume(std::string s) {}
+std::string make(int i);
+void loop(int n) {
+    for (int i = 0; i < n; ++i) {
+        std::string local = make(i);
+        consume(local);
+    }
+    std::string text = make(0);
+    consume(text);
+    text = make(1);
+    consume(text);
+}
+)cpp";
+    const fs::path inPath = writeTestFile("loop_local_input.cpp", input);
+    const fs::path outPath = testDir_ / "loop_local_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("consume(std::move(local))"), std::string::npos);
+    EXPECT_NE(out.find("consume(std::move(text));\n    text = make(1);"), std::string::npos);
+    EXPECT_NE(out.find("text = make(1);\n    consume(std::move(text));"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, OnlyMovesIntoByValueParametersAndSkipsUnneededCfgs) {
+    const std::string input = R"cpp(
+struct Payload {
+    Payload();
+    Payload(const Payload&);
+    Payload(Payload&&);
+    int* data;
+};
+void consume(Payload p) {}
+void observe(const Payload& p) {}
+void f() {
+    Payload p;
+    consume(p);
+}
+void g() {
+    Payload p;
+    observe(p);
+}
+)cpp";
+    const fs::path inPath = writeTestFile("candidates_input.cpp", input);
+    const fs::path outPath = testDir_ / "candidates_output.cpp";
+    const fs::path statsPath = testDir_ / "candidates_stats.txt";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --stats "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" "
+        << "-- -std=c++17 2> \"" << statsPath.string() << "\"";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("consume(std::move(p))"), std::string::npos);
+    EXPECT_EQ(out.find("observe(std::move(p))"), std::string::npos);
+
+    const std::string stats = readFile(statsPath.string());
+    EXPECT_NE(stats.find("functions seen:       4"), std::string::npos) << stats;
+    EXPECT_NE(stats.find("CFGs built:           1"), std::string::npos) << stats;
+    EXPECT_NE(stats.find("CFG builds skipped:   3"), std::string::npos) << stats;
+}
+
 TEST_F(MoveOptimizerTest, MovesByValueParameterOnReturn) {
     const std::string input = R"cpp(
 #include <string>
@@ -152,6 +256,434 @@ std::string makeString() {
     EXPECT_EQ(out.find("return std::move(local);"), std::string::npos);
 }
 
+TEST_F(MoveOptimizerTest, MovesLocalOnlyWhereReturnWouldCopy) {
+    const std::string input = R"cpp(
+#include <string>
+struct Base {
+    std::string name;
+};
+struct Derived : Base {
+    int extra = 0;
+};
+Base slice() {
+    Derived derived;
+    return derived;
+}
+std::string pick(bool first) {
+    std::string a = "a";
+    std::string b = "b";
+    if (first) {
+        return a;
+    }
+    return b;
+}
+)cpp";
+    const fs::path inPath = writeTestFile("ret_local_input.cpp", input);
+    const fs::path outPath = testDir_ / "ret_local_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    // Derived-to-base copies in C++17; the others are moved implicitly.
+    EXPECT_NE(out.find("return std::move(derived);"), std::string::npos);
+    EXPECT_NE(out.find("return a;"), std::string::npos);
+    EXPECT_NE(out.find("return b;"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, MovesAssignmentAndInitializationFromLastUse) {
+    const std::string input = R"cpp(
+#include <string>
+void consume(const std::string& s);
+void assign() {
+    std::string source = "x";
+    std::string target;
+    target = source;
+    consume(target);
+}
+void initialize() {
+    std::string original = "x";
+    std::string duplicate = original;
+    consume(duplicate);
+}
+void stillUsed() {
+    std::string kept = "x";
+    std::string copy = kept;
+    consume(kept);
+    consume(copy);
+}
+void update(std::string value, std::string& out);
+void sameFullExpression() {
+    std::string shared = "x";
+    std::string written;
+    update(shared, written = shared);
+}
+)cpp";
+    const fs::path inPath = writeTestFile("assign_input.cpp", input);
+    const fs::path outPath = testDir_ / "assign_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("target = std::move(source);"), std::string::npos);
+    EXPECT_NE(out.find("std::string duplicate = std::move(original);"), std::string::npos);
+    EXPECT_NE(out.find("std::string copy = kept;"), std::string::npos);
+    // The argument may be copied from shared after the assignment.
+    EXPECT_NE(out.find("update(shared, written = shared);"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, MovesSinkParametersIntoMemberInitializers) {
+    const std::string input = R"cpp(
+#include <string>
+#include <vector>
+class Message {
+public:
+    Message(std::string text, std::vector<int> codes, std::string tag)
+        : text_(text), codes_(codes), tag_(tag), label_(tag) {}
+
+private:
+    std::string text_;
+    std::vector<int> codes_;
+    std::string tag_;
+    std::string label_;
+};
+)cpp";
+    const fs::path inPath = writeTestFile("ctor_init_input.cpp", input);
+    const fs::path outPath = testDir_ / "ctor_init_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("text_(std::move(text))"), std::string::npos);
+    EXPECT_NE(out.find("codes_(std::move(codes))"), std::string::npos);
+    // tag is read again by the next initializer.
+    EXPECT_NE(out.find("tag_(tag)"), std::string::npos);
+    EXPECT_NE(out.find("label_(std::move(tag))"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, TurnsInsertedTemporariesIntoEmplaces) {
+    const std::string input = R"cpp(
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+struct Widget {
+    Widget(int id, std::string name);
+    int id;
+    std::string name;
+};
+template <typename T>
+struct Ring {
+    void push_back(const T& value);
+    void push_back(T&& value);
+    template <typename... Args>
+    void emplace_back(Args&&... args);
+};
+void load(std::vector<Widget>& widgets, std::map<int, std::string>& names,
+          Ring<Widget>& ring, int key, const std::string& value) {
+    widgets.push_back(Widget(key, "widget"));
+    names.insert(std::make_pair(key, value));
+    ring.push_back(Widget(key, "ring"));
+}
+)cpp";
+    const fs::path inPath = writeTestFile("emplace_input.cpp", input);
+    const fs::path outPath = testDir_ / "emplace_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("widgets.emplace_back(key, \"widget\");"), std::string::npos);
+    EXPECT_NE(out.find("names.try_emplace(key, value);"), std::string::npos);
+    // User containers are opt-in.
+    EXPECT_NE(out.find("ring.push_back(Widget(key, \"ring\"));"), std::string::npos);
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --emplace-containers=Ring "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+    out = readFile(outPath.string());
+    EXPECT_NE(out.find("ring.emplace_back(key, \"ring\");"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, TakesConstRefSinkParametersByValue) {
+    const std::string input = R"cpp(
+#include <string>
+#include <vector>
+namespace {
+class Registry {
+public:
+    Registry(const std::string& name);
+    void add(const std::string& entry);
+    void log(const std::string& line);
+    void addTwice(const std::string& entry);
+
+private:
+    std::string name_;
+    std::vector<std::string> entries_;
+};
+Registry::Registry(const std::string& name) : name_(name) {}
+void Registry::add(const std::string& entry) {
+    entries_.push_back(entry);
+}
+void Registry::log(const std::string& line) {
+    std::string copy = line;
+}
+void Registry::addTwice(const std::string& entry) {
+    for (int i = 0; i < 2; ++i) {
+        entries_.push_back(entry);
+    }
+}
+} // namespace
+)cpp";
+    const fs::path inPath = writeTestFile("sink_input.cpp", input);
+    const fs::path outPath = testDir_ / "sink_output.cpp";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --sink-params=rewrite "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("    Registry(std::string name);"), std::string::npos);
+    EXPECT_NE(out.find("Registry::Registry(std::string name) : name_(std::move(name)) {}"),
+              std::string::npos);
+    EXPECT_NE(out.find("    void add(std::string entry);"), std::string::npos);
+    EXPECT_NE(out.find("void Registry::add(std::string entry) {"), std::string::npos);
+    EXPECT_NE(out.find("entries_.push_back(std::move(entry));"), std::string::npos);
+    // Not copied into a member, and copied more than once.
+    EXPECT_NE(out.find("void Registry::log(const std::string& line) {"), std::string::npos);
+    EXPECT_NE(out.find("void Registry::addTwice(const std::string& entry) {"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, KeepsSinkParametersOfAddressTakenOrExportedFunctions) {
+    const std::string input = R"cpp(
+#include <string>
+namespace {
+class Registry {
+public:
+    void rename(const std::string& name);
+    void retitle(const std::string& title);
+
+private:
+    std::string name_;
+    std::string title_;
+};
+void Registry::rename(const std::string& name) {
+    name_ = name;
+}
+void Registry::retitle(const std::string& title) {
+    title_ = title;
+}
+void update(Registry& registry, const std::string& title) {
+    void (Registry::*setter)(const std::string&) = &Registry::retitle;
+    (registry.*setter)(title);
+    registry.rename(title);
+}
+} // namespace
+class Exported {
+public:
+    void rename(const std::string& name);
+
+private:
+    std::string name_;
+};
+void Exported::rename(const std::string& name) {
+    name_ = name;
+}
+)cpp";
+    const fs::path inPath = writeTestFile("sink_unsafe_input.cpp", input);
+    const fs::path outPath = testDir_ / "sink_unsafe_output.cpp";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --sink-params=rewrite "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("void Registry::rename(std::string name) {"), std::string::npos);
+    // Its address is taken, and another unit could declare it.
+    EXPECT_NE(out.find("void Registry::retitle(const std::string& title) {"), std::string::npos);
+    EXPECT_NE(out.find("void Exported::rename(const std::string& name) {"), std::string::npos);
+
+    const int compileResult = compileSource(outPath);
+    if (compileResult == -1) {
+        GTEST_SKIP() << "No C++ compiler available for syntax check";
+    }
+    EXPECT_EQ(compileResult, 0);
+}
+
+TEST_F(MoveOptimizerTest, TakesReadOnlyByValueParametersByConstRef) {
+    const std::string input = R"cpp(
+#include <map>
+#include <string>
+#include <vector>
+static size_t total(std::vector<std::string> names);
+static size_t total(std::vector<std::string> names) {
+    size_t sum = 0;
+    for (const std::string& name : names) {
+        sum += name.size();
+    }
+    return sum;
+}
+static bool contains(const std::map<std::string, int> table, const std::string& key) {
+    return table.count(key) != 0;
+}
+static void append(std::vector<std::string> names) {
+    names.push_back("more");
+}
+static void upper(std::vector<std::string> names) {
+    for (std::string& name : names) {
+        name += "!";
+    }
+}
+)cpp";
+    const fs::path inPath = writeTestFile("readonly_input.cpp", input);
+    const fs::path outPath = testDir_ / "readonly_output.cpp";
+    const fs::path reportPath = testDir_ / "readonly_report.txt";
+
+    std::ostringstream report;
+    report << "\"" << optimizerBinary() << "\" --readonly-params=report "
+           << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" "
+           << "-- -std=c++17 > \"" << reportPath.string() << "\"";
+    ASSERT_EQ(std::system(report.str().c_str()), 0);
+    EXPECT_NE(readFile(reportPath.string()).find("(proposed, apply with --readonly-params=rewrite)"),
+              std::string::npos);
+    EXPECT_EQ(readFile(outPath.string()), input);
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --readonly-params=rewrite "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("static size_t total(const std::vector<std::string>& names);"),
+              std::string::npos);
+    EXPECT_NE(out.find("static size_t total(const std::vector<std::string>& names) {"),
+              std::string::npos);
+    EXPECT_NE(out.find("static bool contains(const std::map<std::string, int>& table,"),
+              std::string::npos);
+    // Modified directly and through the loop variable.
+    EXPECT_NE(out.find("static void append(std::vector<std::string> names) {"),
+              std::string::npos);
+    EXPECT_NE(out.find("static void upper(std::vector<std::string> names) {"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, KeepsReadOnlyParametersOfAddressTakenOrExportedFunctions) {
+    const std::string input = R"cpp(
+#include <functional>
+#include <string>
+#include <vector>
+static size_t tally(std::vector<std::string> names) {
+    return names.size();
+}
+static size_t measure(std::vector<std::string> names) {
+    return names.size();
+}
+size_t exported(std::vector<std::string> names) {
+    return names.size();
+}
+size_t run(const std::vector<std::string>& names) {
+    std::function<size_t(std::vector<std::string>)> counter = measure;
+    return tally(names) + counter(names);
+}
+)cpp";
+    const fs::path inPath = writeTestFile("readonly_unsafe_input.cpp", input);
+    const fs::path outPath = testDir_ / "readonly_unsafe_output.cpp";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --readonly-params=rewrite "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("static size_t tally(const std::vector<std::string>& names) {"),
+              std::string::npos);
+    // Stored in a std::function, and another unit could declare it.
+    EXPECT_NE(out.find("static size_t measure(std::vector<std::string> names) {"),
+              std::string::npos);
+    EXPECT_NE(out.find("size_t exported(std::vector<std::string> names) {"), std::string::npos);
+
+    const int compileResult = compileSource(outPath);
+    if (compileResult == -1) {
+        GTEST_SKIP() << "No C++ compiler available for syntax check";
+    }
+    EXPECT_EQ(compileResult, 0);
+}
+
+TEST_F(MoveOptimizerTest, BindsCopyingRangeForVariablesByReference) {
+    const std::string input = R"cpp(
+#include <string>
+#include <vector>
+void consume(std::string s);
+size_t total(const std::vector<std::string>& names) {
+    size_t sum = 0;
+    for (auto name : names) {
+        sum += name.size();
+    }
+    return sum;
+}
+void drain() {
+    std::vector<std::string> names(4, "name");
+    for (std::string name : names) {
+        name += "!";
+        consume(name);
+    }
+}
+void keep() {
+    std::vector<std::string> names(4, "name");
+    for (std::string name : names) {
+        name += "!";
+    }
+    consume(names.front());
+}
+)cpp";
+    const fs::path inPath = writeTestFile("range_for_input.cpp", input);
+    const fs::path outPath = testDir_ / "range_for_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("for (const auto& name : names) {"), std::string::npos);
+    // The range is dead after the loop and the loop variable is declared
+    // afresh on every iteration, so the elements are modified and moved from
+    // in place.
+    EXPECT_NE(out.find("for (std::string& name : names) {\n        name += \"!\";\n"
+                       "        consume(std::move(name));"),
+              std::string::npos);
+    // Still read after the loop.
+    const size_t keep = out.find("void keep()");
+    ASSERT_NE(keep, std::string::npos);
+    EXPECT_NE(out.find("for (std::string name : names) {", keep), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, KeepsRangeForCopiesWhenTheBodyWritesTheRange) {
+    const std::string input = R"cpp(
+#include <string>
+#include <vector>
+void log(const std::string& s);
+void relabel() {
+    std::vector<std::string> names(4, "name");
+    size_t i = 0;
+    for (auto name : names) {
+        names[i++] = "x";
+        log(name);
+    }
+    log(names.front());
+}
+size_t measure() {
+    std::vector<std::string> labels(4, "label");
+    size_t total = 0;
+    for (auto label : labels) {
+        total += label.size() + labels.size();
+    }
+    log(labels.front());
+    return total;
+}
+)cpp";
+    const fs::path inPath = writeTestFile("range_write_input.cpp", input);
+    const fs::path outPath = testDir_ / "range_write_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("for (auto name : names) {"), std::string::npos);
+    // Only read through the range
+    EXPECT_NE(out.find("for (const auto& label : labels) {"), std::string::npos);
+}
+
 TEST_F(MoveOptimizerTest, TransformedOutputCompiles) {
     const std::string input = R"cpp(
 #include <string>
@@ -172,6 +704,528 @@ std::string process(std::string value) {
     EXPECT_EQ(compileResult, 0);
 }
 
+TEST_F(MoveOptimizerTest, ParallelJobsMatchSerialOutputAndIsolateFailures) {
+    const std::string first = R"cpp(
+#include <string>
+void consume(std::string s) {}
+void first() {
+    std::string local = "first";
+    consume(local);
+}
+)cpp";
+    const std::string second = R"cpp(
+#include <vector>
+void sink(std::vector<int> v) {}
+void second() {
+    std::vector<int> values(4, 2);
+    sink(values);
+}
+)cpp";
+    const fs::path firstPath = writeTestFile("parallel_first.cpp", first);
+    const fs::path secondPath = writeTestFile("parallel_second.cpp", second);
+    const fs::path brokenPath = writeTestFile("parallel_broken.cpp", "void broken( {\n");
+    const fs::path serialDir = testDir_ / "serial_out";
+    const fs::path parallelDir = testDir_ / "parallel_out";
+
+    std::ostringstream serial;
+    serial << "\"" << optimizerBinary() << "\" "
+           << "\"" << firstPath.string() << "\" \"" << secondPath.string() << "\" "
+           << "--out-dir \"" << serialDir.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(serial.str().c_str()), 0);
+
+    std::ostringstream parallel;
+    parallel << "\"" << optimizerBinary() << "\" -j 3 "
+             << "\"" << firstPath.string() << "\" \"" << brokenPath.string() << "\" "
+             << "\"" << secondPath.string() << "\" "
+             << "--out-dir \"" << parallelDir.string() << "\" -- -std=c++17";
+    EXPECT_NE(std::system(parallel.str().c_str()), 0);
+
+    for (const char* name : {"parallel_first.cpp.optimized", "parallel_second.cpp.optimized"}) {
+        const std::string expected = readFile((serialDir / name).string());
+        ASSERT_FALSE(expected.empty()) << name;
+        EXPECT_EQ(readFile((parallelDir / name).string()), expected) << name;
+    }
+}
+
+TEST_F(MoveOptimizerTest, WritesNextToSourcesOfOtherCompileDirectories) {
+    const fs::path projectDir = testDir_ / "project";
+    const fs::path sourceDir = projectDir / "src";
+    fs::create_directories(sourceDir);
+    const fs::path sourcePath = sourceDir / "db_input.cpp";
+    {
+        std::ofstream source(sourcePath);
+        source << "#include <string>\n"
+               << "void consume(std::string s) {}\n"
+               << "void produce() {\n"
+               << "    std::string local = \"relative\";\n"
+               << "    consume(local);\n"
+               << "}\n";
+    }
+    {
+        // The command names the file relative to its own directory.
+        std::ofstream database(projectDir / "compile_commands.json");
+        database << "[{\"directory\": \"" << sourceDir.string() << "\", "
+                 << "\"command\": \"c++ -std=c++17 -c db_input.cpp\", "
+                 << "\"file\": \"db_input.cpp\"}]\n";
+    }
+
+    std::ostringstream parallel;
+    parallel << "cd \"" << testDir_.string() << "\" && \"" << optimizerBinary() << "\" -j 2 "
+             << "-p project project/src/db_input.cpp";
+    ASSERT_EQ(std::system(parallel.str().c_str()), 0);
+    EXPECT_NE(readFile(sourcePath.string() + ".optimized").find("consume(std::move(local));"),
+              std::string::npos);
+    EXPECT_FALSE(fs::exists(testDir_ / "db_input.cpp.optimized"));
+
+    std::ostringstream inPlace;
+    inPlace << "cd \"" << testDir_.string() << "\" && \"" << optimizerBinary() << "\" -j 2 "
+            << "--in-place -p project project/src/db_input.cpp";
+    ASSERT_EQ(std::system(inPlace.str().c_str()), 0);
+    EXPECT_NE(readFile(sourcePath.string()).find("consume(std::move(local));"),
+              std::string::npos);
+    EXPECT_FALSE(fs::exists(testDir_ / "db_input.cpp"));
+}
+
+TEST_F(MoveOptimizerTest, HandlesFunctionsWithThousandsOfBlocks) {
+    std::ostringstream input;
+    input << "#include <string>\n"
+          << "void consume(std::string s) {}\n"
+          << "void observe(const std::string& s) {}\n"
+          << "int stress(int flag) {\n"
+          << "    std::string once = \"once\";\n"
+          << "    consume(once);\n"
+          << "    std::string kept = \"kept\";\n"
+          << "    int counter = 0;\n";
+    for (int i = 0; i < 3000; ++i) {
+        input << "    if (flag == " << i << ") { counter += " << i << "; observe(kept); }\n";
+    }
+    input << "    while (flag-- > 0) {\n"
+          << "        consume(kept);\n"
+          << "    }\n"
+          << "    return counter;\n"
+          << "}\n";
+    const fs::path inPath = writeTestFile("stress_input.cpp", input.str());
+    const fs::path outPath = testDir_ / "stress_output.cpp";
+
+    ASSERT_EQ(runOptimizer(inPath, outPath), 0);
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("consume(std::move(once));"), std::string::npos);
+    EXPECT_EQ(out.find("std::move(kept)"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, CachedResultsReplayUntilADependencyChanges) {
+    writeTestFile("cache_sink.h", "#include <string>\nvoid consume(std::string s);\n");
+    const fs::path inPath = writeTestFile("cache_input.cpp", R"cpp(
+#include "cache_sink.h"
+void produce() {
+    std::string local = "cached";
+    consume(local);
+}
+)cpp");
+    const fs::path outPath = testDir_ / "cache_output.cpp";
+    const fs::path cacheDir = testDir_ / "cache";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" "
+        << "--cache-dir \"" << cacheDir.string() << "\" "
+        << "-- -std=c++17 -I\"" << testDir_.string() << "\"";
+
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+    const std::string first = readFile(outPath.string());
+    EXPECT_NE(first.find("consume(std::move(local));"), std::string::npos);
+    ASSERT_FALSE(fs::is_empty(cacheDir));
+
+    fs::remove(outPath);
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+    EXPECT_EQ(readFile(outPath.string()), first);
+
+    // A header change invalidates the entry even though the main file is unchanged.
+    writeTestFile("cache_sink.h", "#include <string>\nvoid consume(const std::string& s);\n");
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+    EXPECT_EQ(readFile(outPath.string()).find("std::move(local)"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, ReusesDecisionsForUnchangedFunctions) {
+    const std::string stable = R"cpp(
+#include <string>
+void consume(std::string s) {}
+void stable() {
+    std::string kept = "stable";
+    consume(kept);
+}
+)cpp";
+    const fs::path inPath = writeTestFile("incremental_input.cpp", stable +
+        "void edited() {\n    std::string local = \"one\";\n    consume(local);\n}\n");
+    const fs::path outPath = testDir_ / "incremental_output.cpp";
+    const fs::path statsPath = testDir_ / "incremental_stats.txt";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --stats "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" "
+        << "--cache-dir \"" << (testDir_ / "cache").string() << "\" "
+        << "-- -std=c++17 2>\"" << statsPath.string() << "\"";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    // Changing one function leaves the other's stored decisions valid.
+    writeTestFile("incremental_input.cpp", stable +
+        "void edited() {\n    std::string local = \"two\";\n    consume(local);\n"
+        "    consume(local);\n}\n");
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string out = readFile(outPath.string());
+    EXPECT_NE(out.find("consume(std::move(kept));"), std::string::npos);
+    EXPECT_NE(out.find("consume(local);\n    consume(std::move(local));"), std::string::npos);
+    EXPECT_NE(readFile(statsPath.string()).find("functions reused:     2"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, ServerModeMatchesDirectRunAcrossEdits) {
+    const std::string header = R"cpp(
+#include <string>
+#include <vector>
+void consume(std::string s) {}
+)cpp";
+    const fs::path inPath = writeTestFile("served_input.cpp", header +
+        "void produce() {\n    std::string local = \"served\";\n    consume(local);\n}\n");
+    const fs::path directPath = testDir_ / "served_direct.cpp";
+    const fs::path servedPath = testDir_ / "served_output.cpp";
+    const fs::path socketPath = testDir_ / "server.sock";
+
+    std::ostringstream serve;
+    serve << "\"" << optimizerBinary() << "\" --serve=\"" << socketPath.string() << "\" "
+          << "-- -std=c++17 >/dev/null 2>&1 &";
+    ASSERT_EQ(std::system(serve.str().c_str()), 0);
+    for (int i = 0; i < 200 && !fs::exists(socketPath); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    ASSERT_TRUE(fs::exists(socketPath));
+
+    auto runClient = [&](bool shutdown) {
+        std::ostringstream cmd;
+        cmd << "\"" << optimizerBinary() << "\" --connect=\"" << socketPath.string() << "\" "
+            << (shutdown ? "--shutdown-server " : "")
+            << "\"" << inPath.string() << "\" -o \"" << servedPath.string() << "\"";
+        return std::system(cmd.str().c_str());
+    };
+
+    ASSERT_EQ(runClient(false), 0);
+    ASSERT_EQ(runOptimizer(inPath, directPath), 0);
+    EXPECT_EQ(readFile(servedPath.string()), readFile(directPath.string()));
+    EXPECT_NE(readFile(servedPath.string()).find("consume(std::move(local));"), std::string::npos);
+
+    // An edit below the includes keeps the preamble and still gets fresh results.
+    writeTestFile("served_input.cpp", header +
+        "void produce() {\n    std::string local = \"served\";\n    consume(local);\n"
+        "    consume(local);\n}\n");
+    ASSERT_EQ(runClient(true), 0);
+    ASSERT_EQ(runOptimizer(inPath, directPath), 0);
+    EXPECT_EQ(readFile(servedPath.string()), readFile(directPath.string()));
+
+    for (int i = 0; i < 200 && fs::exists(socketPath); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    EXPECT_FALSE(fs::exists(socketPath));
+}
+
+TEST_F(MoveOptimizerTest, ServerKeepsFilesThatAreNotStaleSockets) {
+    const fs::path sourcePath = writeTestFile("not_a_socket.cpp", "int kept;\n");
+
+    std::ostringstream serve;
+    serve << "\"" << optimizerBinary() << "\" --serve=\"" << sourcePath.string() << "\" "
+          << "-- -std=c++17 2>/dev/null";
+    EXPECT_NE(std::system(serve.str().c_str()), 0);
+    EXPECT_EQ(readFile(sourcePath.string()), "int kept;\n");
+}
+
+TEST_F(MoveOptimizerTest, SkipsHeaderFunctionBodiesOnRequest) {
+    // The header body is never type-checked when header bodies are skipped.
+    writeTestFile("skipped_bodies.h", "inline void helper() { undeclared_function(); }\n");
+    const fs::path inPath = writeTestFile("skipped_bodies.cpp", R"cpp(
+#include "skipped_bodies.h"
+#include <string>
+void consume(std::string s) {}
+void produce() {
+    std::string local = "kept";
+    consume(local);
+}
+)cpp");
+    const fs::path outPath = testDir_ / "skipped_bodies_output.cpp";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --skip-function-bodies=headers "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" "
+        << "-- -std=c++17 -I\"" << testDir_.string() << "\"";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+    EXPECT_NE(readFile(outPath.string()).find("consume(std::move(local));"), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, WritesOnlyChangedFilesAndSupportsInPlace) {
+    const fs::path unchangedPath = writeTestFile("unchanged_input.cpp",
+        "int unchanged(int value) {\n    return value + 1;\n}\n");
+    const fs::path changedPath = writeTestFile("in_place_input.cpp", R"cpp(
+#include <string>
+void consume(std::string s) {}
+void produce() {
+    std::string local = "in place";
+    consume(local);
+}
+)cpp");
+
+    std::ostringstream defaultOutput;
+    defaultOutput << "\"" << optimizerBinary() << "\" "
+                  << "\"" << unchangedPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(defaultOutput.str().c_str()), 0);
+    EXPECT_FALSE(fs::exists(unchangedPath.string() + ".optimized"));
+
+    std::ostringstream inPlace;
+    inPlace << "\"" << optimizerBinary() << "\" --in-place "
+            << "\"" << unchangedPath.string() << "\" \"" << changedPath.string() << "\" "
+            << "-- -std=c++17";
+    ASSERT_EQ(std::system(inPlace.str().c_str()), 0);
+    EXPECT_EQ(readFile(unchangedPath.string()),
+              "int unchanged(int value) {\n    return value + 1;\n}\n");
+    EXPECT_NE(readFile(changedPath.string()).find("consume(std::move(local));"),
+              std::string::npos);
+    EXPECT_FALSE(fs::exists(changedPath.string() + ".optimized"));
+}
+
+TEST_F(MoveOptimizerTest, ExportsReplacementsWithoutWritingSources) {
+    const fs::path inPath = writeTestFile("export_input.cpp", R"cpp(
+#include <string>
+void consume(std::string s) {}
+void produce() {
+    std::string local = "exported";
+    consume(local);
+}
+)cpp");
+    const fs::path jsonlPath = testDir_ / "edits.jsonl";
+    const fs::path yamlDir = testDir_ / "fixes";
+
+    std::ostringstream jsonl;
+    jsonl << "\"" << optimizerBinary() << "\" --export-format=jsonl "
+          << "--export-replacements=\"" << jsonlPath.string() << "\" "
+          << "\"" << inPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(jsonl.str().c_str()), 0);
+    const std::string edits = readFile(jsonlPath.string());
+    EXPECT_NE(edits.find("\"text\":\"std::move(\""), std::string::npos);
+    EXPECT_NE(edits.find("export_input.cpp"), std::string::npos);
+    EXPECT_FALSE(fs::exists(inPath.string() + ".optimized"));
+
+    std::ostringstream yaml;
+    yaml << "\"" << optimizerBinary() << "\" "
+         << "--export-replacements=\"" << yamlDir.string() << "\" "
+         << "\"" << inPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(yaml.str().c_str()), 0);
+    size_t yamlFiles = 0;
+    for (const fs::directory_entry& entry : fs::directory_iterator(yamlDir)) {
+        EXPECT_EQ(entry.path().extension(), ".yaml");
+        EXPECT_NE(readFile(entry.path().string()).find("MainSourceFile:"), std::string::npos);
+        ++yamlFiles;
+    }
+    EXPECT_EQ(yamlFiles, 1u);
+    EXPECT_FALSE(fs::exists(inPath.string() + ".optimized"));
+}
+
+TEST_F(MoveOptimizerTest, RewritesSharedHeaderOnceUnderHeaderRoot) {
+    const fs::path headerPath = writeTestFile("shared_header.h", R"cpp(#pragma once
+#include <string>
+inline void sink(std::string s) {}
+inline void forward() {
+    std::string local = "shared";
+    sink(local);
+}
+)cpp");
+    const fs::path firstPath = writeTestFile("header_user_a.cpp",
+        "#include \"shared_header.h\"\nvoid a() { forward(); }\n");
+    const fs::path secondPath = writeTestFile("header_user_b.cpp",
+        "#include \"shared_header.h\"\nvoid b() { forward(); }\n");
+    const fs::path outDir = testDir_ / "header_out";
+
+    std::ostringstream withoutRoot;
+    withoutRoot << "\"" << optimizerBinary() << "\" "
+                << "\"" << firstPath.string() << "\" \"" << secondPath.string() << "\" "
+                << "--out-dir \"" << outDir.string() << "\" "
+                << "-- -std=c++17 -I\"" << testDir_.string() << "\"";
+    ASSERT_EQ(std::system(withoutRoot.str().c_str()), 0);
+    EXPECT_FALSE(fs::exists(outDir / "shared_header.h.optimized"));
+
+    std::ostringstream withRoot;
+    withRoot << "\"" << optimizerBinary() << "\" --header-root=\"" << testDir_.string() << "\" "
+             << "\"" << firstPath.string() << "\" \"" << secondPath.string() << "\" "
+             << "--out-dir \"" << outDir.string() << "\" "
+             << "-- -std=c++17 -I\"" << testDir_.string() << "\"";
+    ASSERT_EQ(std::system(withRoot.str().c_str()), 0);
+
+    // Both units report the same edits; they must be applied only once.
+    const std::string header = readFile((outDir / "shared_header.h.optimized").string());
+    EXPECT_NE(header.find("sink(std::move(local));"), std::string::npos);
+    EXPECT_EQ(header.find("std::move(std::move("), std::string::npos);
+    const size_t utility = header.find("#include <utility>");
+    ASSERT_NE(utility, std::string::npos);
+    EXPECT_EQ(header.find("#include <utility>", utility + 1), std::string::npos);
+    EXPECT_FALSE(fs::exists(outDir / "header_user_a.cpp.optimized"));
+}
+
+TEST_F(MoveOptimizerTest, WritesTimeTraceAndExtendedStats) {
+    // No standard headers, so that every candidate is in this file.
+    const fs::path inPath = writeTestFile("traced_input.cpp", R"cpp(
+struct Buffer {
+    Buffer() = default;
+    Buffer(const Buffer&) = default;
+    Buffer(Buffer&&) = default;
+    int* data = nullptr;
+};
+void consume(Buffer b) {}
+void produce() {
+    Buffer local;
+    consume(local);
+}
+)cpp");
+    const fs::path outPath = testDir_ / "traced_output.cpp";
+    const fs::path tracePath = testDir_ / "trace.json";
+    const fs::path statsPath = testDir_ / "stats.txt";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --stats --time-trace-granularity=0 "
+        << "--time-trace=\"" << tracePath.string() << "\" "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" "
+        << "-- -std=c++17 2> \"" << statsPath.string() << "\"";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string trace = readFile(tracePath.string());
+    EXPECT_NE(trace.find("\"traceEvents\""), std::string::npos);
+    EXPECT_NE(trace.find("TranslationUnit"), std::string::npos);
+    EXPECT_NE(trace.find("AnalyzeFunction"), std::string::npos);
+
+    const std::string stats = readFile(statsPath.string());
+    EXPECT_NE(stats.find("candidates:           1"), std::string::npos);
+    EXPECT_NE(stats.find("moves applied:        1"), std::string::npos);
+    EXPECT_NE(stats.find("bytes written:        " +
+                         std::to_string(readFile(outPath.string()).size())),
+              std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, RanksCandidatesByCopyCostAndAppliesThreshold) {
+    const fs::path inPath = writeTestFile("cost_input.cpp", R"cpp(
+#include <string>
+#include <vector>
+struct Small {
+    Small();
+    Small(const Small&);
+    Small(Small&&);
+    int values[4];
+};
+void takeSmall(Small s);
+void takeNames(std::vector<std::string> names);
+void produce() {
+    Small small;
+    std::vector<std::string> names;
+    takeSmall(small);
+    takeNames(names);
+}
+)cpp");
+    const fs::path outPath = testDir_ / "cost_output.cpp";
+    const fs::path reportPath = testDir_ / "cost_report.txt";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --report-candidates --min-copy-cost=100 "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" "
+        << "-- -std=c++17 > \"" << reportPath.string() << "\"";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string output = readFile(outPath.string());
+    EXPECT_NE(output.find("takeNames(std::move(names));"), std::string::npos);
+    EXPECT_NE(output.find("takeSmall(small);"), std::string::npos);
+
+    const std::string report = readFile(reportPath.string());
+    const size_t names = report.find("'names'");
+    const size_t small = report.find("'small'");
+    ASSERT_NE(names, std::string::npos);
+    ASSERT_NE(small, std::string::npos);
+    EXPECT_LT(names, small);
+    EXPECT_NE(report.find("(below --min-copy-cost)", small), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, RestrictsMovesToHotFunctionsFromProfile) {
+    const fs::path inPath = writeTestFile("profile_input.cpp", R"cpp(
+#include <string>
+void consume(std::string s);
+void hot() {
+    std::string text;
+    consume(text);
+}
+void cold() {
+    std::string text;
+    consume(text);
+}
+)cpp");
+    // Sample profile text: the hot function by mangled, the cold one by
+    // plain name. Indented body lines are ignored.
+    const fs::path profilePath = writeTestFile("profile.txt",
+                                               "_Z3hotv:5000:12\n"
+                                               " 1: 5000\n"
+                                               "cold:3:1\n"
+                                               " 1: 3\n");
+    const fs::path outPath = testDir_ / "profile_output.cpp";
+    const fs::path reportPath = testDir_ / "profile_report.txt";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --profile=\"" << profilePath.string() << "\" "
+        << "--min-function-count=100 --report-candidates "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" "
+        << "-- -std=c++17 > \"" << reportPath.string() << "\"";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string output = readFile(outPath.string());
+    const size_t cold = output.find("void cold()");
+    ASSERT_NE(cold, std::string::npos);
+    EXPECT_LT(output.find("consume(std::move(text));"), cold);
+    EXPECT_NE(output.find("consume(text);", cold), std::string::npos);
+
+    const std::string report = readFile(reportPath.string());
+    const size_t hotEntry = report.find("in hot");
+    const size_t coldEntry = report.find("in cold");
+    ASSERT_NE(hotEntry, std::string::npos);
+    ASSERT_NE(coldEntry, std::string::npos);
+    EXPECT_LT(hotEntry, coldEntry);
+    EXPECT_NE(report.find("count 5000"), std::string::npos);
+    EXPECT_NE(report.find("(below --min-function-count)", coldEntry), std::string::npos);
+}
+
+TEST_F(MoveOptimizerTest, MatchesConstructorsByBaseObjectSymbolInProfile) {
+    const fs::path inPath = writeTestFile("profile_ctor_input.cpp", R"cpp(
+struct Name {
+    Name();
+    Name(const Name&);
+    Name(Name&&);
+};
+struct Hot {
+    Hot(Name n);
+    Name n_;
+};
+struct Cold {
+    Cold(Name n);
+    Name n_;
+};
+Hot::Hot(Name n) : n_(n) {}
+Cold::Cold(Name n) : n_(n) {}
+)cpp");
+    // Only the base-object constructor, under a ThinLTO clone name
+    const fs::path profilePath =
+        writeTestFile("profile_ctor.txt", "_ZN3HotC2E4Name.llvm.4711 5000\n");
+    const fs::path outPath = testDir_ / "profile_ctor_output.cpp";
+
+    std::ostringstream cmd;
+    cmd << "\"" << optimizerBinary() << "\" --profile=\"" << profilePath.string() << "\" "
+        << "--min-function-count=100 "
+        << "\"" << inPath.string() << "\" -o \"" << outPath.string() << "\" -- -std=c++17";
+    ASSERT_EQ(std::system(cmd.str().c_str()), 0);
+
+    const std::string output = readFile(outPath.string());
+    EXPECT_NE(output.find("Hot::Hot(Name n) : n_(std::move(n)) {}"), std::string::npos);
+    EXPECT_NE(output.find("Cold::Cold(Name n) : n_(n) {}"), std::string::npos);
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();